@@ -0,0 +1,152 @@
+/*
+ * (c) 2012 Thomas Wihl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "CacheControl.h"
+
+#include <cassert>
+
+CacheControl* CacheControl::mCacheControl = nullptr;
+
+#define DSB() __asm volatile("dsb" : : : "memory")
+#define ISB() __asm volatile("isb" : : : "memory")
+
+CacheControl::CacheControl(System::BaseAddress scb, System::BaseAddress mpu) :
+    mCcr(reinterpret_cast<volatile uint32_t*>(scb + CCR_OFFSET)),
+    mCcsidr(reinterpret_cast<volatile uint32_t*>(scb + CCSIDR_OFFSET)),
+    mCsselr(reinterpret_cast<volatile uint32_t*>(scb + CSSELR_OFFSET)),
+    mCache(reinterpret_cast<volatile CACHE*>(scb + CACHE_OFFSET)),
+    mMpu(reinterpret_cast<volatile MPU*>(mpu)),
+    mDataCacheEnabled((*mCcr & CCR_DC) != 0),
+    mNonCacheableNext(0),
+    mNonCacheableEnd(0)
+{
+    static_assert(sizeof(CACHE) == 0x28, "Struct has wrong size, compiler problem.");
+    static_assert(sizeof(MPU) == 0x14, "Struct has wrong size, compiler problem.");
+    assert(mCacheControl == nullptr);
+    mCacheControl = this;
+}
+
+CacheControl::~CacheControl()
+{
+    mCacheControl = nullptr;
+}
+
+void CacheControl::enableInstructionCache()
+{
+    DSB();
+    ISB();
+    mCache->ICIALLU = 0;
+    DSB();
+    ISB();
+    *mCcr |= CCR_IC;
+    DSB();
+    ISB();
+}
+
+void CacheControl::enableDataCache()
+{
+    if (mDataCacheEnabled) return;
+    // The content of the cache is undefined after reset.
+    forEachSetWay(&mCache->DCISW);
+    *mCcr |= CCR_DC;
+    DSB();
+    ISB();
+    mDataCacheEnabled = true;
+}
+
+void CacheControl::disableDataCache()
+{
+    if (!mDataCacheEnabled) return;
+    mDataCacheEnabled = false;
+    *mCcr &= ~CCR_DC;
+    DSB();
+    forEachSetWay(&mCache->DCCISW);
+    ISB();
+}
+
+bool CacheControl::configNonCacheable(unsigned int region, System::BaseAddress address, unsigned int size)
+{
+    if (size < 32 || (size & (size - 1)) != 0 || (address & (size - 1)) != 0 || region >= mMpu->TYPE.DREGION) return false;
+    // Whatever is cached from there has to go before the region becomes uncacheable.
+    cleanInvalidate(address, size);
+    unsigned int sizeBits = 30 - __builtin_clz(size);
+    __asm volatile("dmb" : : : "memory");
+    mMpu->RNR = region;
+    mMpu->RBAR = address;
+    // Execute never, full access, normal memory not cacheable (TEX 1, C 0, B 0), shareable, size 2^(sizeBits + 1).
+    mMpu->RASR = (1 << 28) | (3 << 24) | (1 << 19) | (1 << 18) | (sizeBits << 1) | 1;
+    // Everything outside of the regions keeps the default memory map.
+    mMpu->CTRL = (1 << 2) | 1;
+    DSB();
+    ISB();
+    mNonCacheableNext = address;
+    mNonCacheableEnd = address + size;
+    return true;
+}
+
+void *CacheControl::allocateNonCacheable(unsigned int size, unsigned int alignment)
+{
+    System::BaseAddress start = (mNonCacheableNext + alignment - 1) & ~(alignment - 1);
+    if (start + size > mNonCacheableEnd || start < mNonCacheableNext) return nullptr;
+    mNonCacheableNext = start + size;
+    return reinterpret_cast<void*>(start);
+}
+
+void CacheControl::clean(System::BaseAddress address, unsigned int size)
+{
+    if (!active() || size == 0) return;
+    DSB();
+    for (System::BaseAddress line = address & ~(LINE_SIZE - 1); line < address + size; line += LINE_SIZE) mCacheControl->mCache->DCCMVAC = line;
+    DSB();
+    ISB();
+}
+
+void CacheControl::invalidate(System::BaseAddress address, unsigned int size)
+{
+    if (!active() || size == 0) return;
+    DSB();
+    for (System::BaseAddress line = address & ~(LINE_SIZE - 1); line < address + size; line += LINE_SIZE) mCacheControl->mCache->DCIMVAC = line;
+    DSB();
+    ISB();
+}
+
+void CacheControl::cleanInvalidate(System::BaseAddress address, unsigned int size)
+{
+    if (!active() || size == 0) return;
+    DSB();
+    for (System::BaseAddress line = address & ~(LINE_SIZE - 1); line < address + size; line += LINE_SIZE) mCacheControl->mCache->DCCIMVAC = line;
+    DSB();
+    ISB();
+}
+
+// Runs a set/way operation over the whole level 1 data cache.
+void CacheControl::forEachSetWay(volatile uint32_t *operation)
+{
+    *mCsselr = 0;
+    DSB();
+    uint32_t ccsidr = *mCcsidr;
+    unsigned int sets = ((ccsidr >> 13) & 0x7fff) + 1;
+    unsigned int ways = ((ccsidr >> 3) & 0x3ff) + 1;
+    unsigned int lineShift = (ccsidr & 7) + 4;
+    unsigned int wayShift = ways > 1 ? __builtin_clz(ways - 1) : 0;
+    for (unsigned int set = 0; set < sets; ++set)
+    {
+        for (unsigned int way = 0; way < ways; ++way) *operation = (way << wayShift) | (set << lineShift);
+    }
+    DSB();
+}
@@ -0,0 +1,108 @@
+/*
+ * (c) 2012 Thomas Wihl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef CACHECONTROL_H
+#define CACHECONTROL_H
+
+#include "System.h"
+
+#include <cstdint>
+
+// The L1 caches of the Cortex-M7 and the MPU regions to keep memory out of them.
+// DMA doesn't see the data cache, so before a DMA reads memory it has to be cleaned (written back) and after
+// a DMA wrote memory it has to be invalidated, Dma::Stream does both with the static functions below.
+// Invalidating works on whole lines of LINE_SIZE, so DMA buffers must not share a line with other data, see DmaBuffer.
+class CacheControl
+{
+public:
+    static const unsigned int LINE_SIZE = 32;
+
+    CacheControl(System::BaseAddress scb, System::BaseAddress mpu);
+    ~CacheControl();
+
+    void enableInstructionCache();
+    void enableDataCache();
+    void disableDataCache();
+    bool dataCacheEnabled() const { return mDataCacheEnabled; }
+
+    // Maps size bytes from address as normal memory that is never cached, for small buffers shared with DMA that
+    // aren't worth the maintenance. The size has to be a power of two of at least 32, the address aligned to it.
+    bool configNonCacheable(unsigned int region, System::BaseAddress address, unsigned int size);
+    // Takes memory from the non cacheable region, nullptr if it is used up.
+    void* allocateNonCacheable(unsigned int size, unsigned int alignment = 4);
+
+    // No operation, unless the data cache is enabled.
+    static void clean(System::BaseAddress address, unsigned int size);
+    static void invalidate(System::BaseAddress address, unsigned int size);
+    static void cleanInvalidate(System::BaseAddress address, unsigned int size);
+
+    static inline CacheControl* instance() { return mCacheControl; }
+
+private:
+    // Cache maintenance operations, starting at 0x250 from the SCB.
+    struct CACHE
+    {
+        uint32_t ICIALLU;
+        uint32_t __RESERVED0;
+        uint32_t ICIMVAU;
+        uint32_t DCIMVAC;
+        uint32_t DCISW;
+        uint32_t DCCMVAU;
+        uint32_t DCCMVAC;
+        uint32_t DCCSW;
+        uint32_t DCCIMVAC;
+        uint32_t DCCISW;
+    };
+    struct MPU
+    {
+        struct __TYPE
+        {
+            uint32_t SEPARATE : 1;
+            uint32_t __RESERVED0 : 7;
+            uint32_t DREGION : 8;
+            uint32_t IREGION : 8;
+            uint32_t __RESERVED1 : 8;
+        }   TYPE;
+        uint32_t CTRL;
+        uint32_t RNR;
+        uint32_t RBAR;
+        uint32_t RASR;
+    };
+    static const uint32_t CCR_OFFSET = 0x14;
+    static const uint32_t CCSIDR_OFFSET = 0x80;
+    static const uint32_t CSSELR_OFFSET = 0x84;
+    static const uint32_t CACHE_OFFSET = 0x250;
+    static const uint32_t CCR_DC = 1 << 16;
+    static const uint32_t CCR_IC = 1 << 17;
+
+    static CacheControl* mCacheControl;
+
+    volatile uint32_t* mCcr;
+    volatile uint32_t* mCcsidr;
+    volatile uint32_t* mCsselr;
+    volatile CACHE* mCache;
+    volatile MPU* mMpu;
+    bool mDataCacheEnabled;
+    System::BaseAddress mNonCacheableNext;
+    System::BaseAddress mNonCacheableEnd;
+
+    void forEachSetWay(volatile uint32_t* operation);
+    static bool active() { return mCacheControl != nullptr && mCacheControl->mDataCacheEnabled; }
+};
+
+#endif // CACHECONTROL_H
@@ -19,19 +19,82 @@
 #ifndef CIRCULARBUFFER_H
 #define CIRCULARBUFFER_H
 
+#include "atomic.h"
+
 #include <algorithm>
+#include <cstdint>
 #include <cstring>
+#include <type_traits>
+
+// Storage of a CircularBuffer, either inside the object with a capacity known at compile time
+// (N > 0, must be a power of two) or allocated once on the heap with the size given at runtime (N = 0).
+template<typename T, unsigned int N>
+class CircularBufferStorage
+{
+protected:
+    CircularBufferStorage(unsigned int /*size*/) { }
+
+    static constexpr unsigned int capacity() { return N; }
+    inline T* buffer() { return mBuffer; }
+
+private:
+    static_assert(N != 0 && (N & (N - 1)) == 0, "CircularBuffer capacity has to be a power of two.");
+    T mBuffer[N];
+};
 
+// The heap storage starts on and fills whole cache lines, so a DMA writing into it can be kept coherent with the
+// data cache without touching other data.
 template<typename T>
-class CircularBuffer
+class CircularBufferStorage<T, 0>
+{
+protected:
+    CircularBufferStorage(unsigned int size) :
+        mSize(roundUp(size)),
+        mMemory(new uint8_t[(mSize * sizeof(T) + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT + ALIGNMENT - 1]),
+        mBuffer(reinterpret_cast<T*>((reinterpret_cast<uintptr_t>(mMemory) + ALIGNMENT - 1) & ~static_cast<uintptr_t>(ALIGNMENT - 1)))
+    { }
+    ~CircularBufferStorage() { delete[] mMemory; }
+
+    inline unsigned int capacity() const { return mSize; }
+    inline T* buffer() { return mBuffer; }
+
+private:
+    static const unsigned int ALIGNMENT = 32;
+    static_assert(std::is_trivial<T>::value, "The elements aren't constructed, so they must not need it.");
+    unsigned int mSize;
+    uint8_t* mMemory;
+    T* mBuffer;
+
+    static unsigned int roundUp(unsigned int size)
+    {
+        unsigned int powerOfTwo = 1;
+        while (powerOfTwo < size) powerOfTwo <<= 1;
+        return powerOfTwo;
+    }
+};
+
+// Lock free ring buffer for one producer and one consumer (e.g. main loop and an ISR or DMA).
+// The capacity is a power of two, so wrapping is a simple mask. The write and read
+// index are free running, the write index is only modified by the producer and the read index
+// only by the consumer, so used() and free() don't need any read-modify-write.
+// CircularBuffer<T, N> keeps its elements inside the object (so they end up in .bss),
+// CircularBuffer<T> allocates them from the heap and rounds the size up to a power of two.
+template<typename T, unsigned int N = 0>
+class CircularBuffer : protected CircularBufferStorage<T, N>
 {
 public:
-    CircularBuffer(unsigned int size);
-    ~CircularBuffer();
+    // A contiguous part of the buffer, reserved for writing or ready for reading.
+    struct Region
+    {
+        T* data;
+        unsigned int len;
+    };
+
+    CircularBuffer(unsigned int size = N) : CircularBufferStorage<T, N>(size), mWrite(0), mRead(0) { }
 
-    inline unsigned int used() { return mUsed;}
-    inline unsigned int free() { return mSize - used(); }
-    inline unsigned int size() { return mSize; }
+    inline unsigned int used() { return atomic_load_acquire(&mWrite) - atomic_load_acquire(&mRead); }
+    inline unsigned int free() { return size() - used(); }
+    inline unsigned int size() { return this->capacity(); }
 
     bool push(T elem);
     bool pop(T &elem);
@@ -41,29 +104,159 @@ public:
     unsigned int read(T* data, unsigned int len);
     T operator[](int index);
 
-    T *writePointer();
-    T* readPointer();
-    T* bufferPointer();
+    inline T* writePointer() { return this->buffer() + index(mWrite); }
+    inline T* readPointer() { return this->buffer() + index(mRead); }
+    inline T* bufferPointer() { return this->buffer(); }
 
     unsigned int getContBuffer(const T*& data);
     unsigned int skip(unsigned int len);
     unsigned int add(unsigned int len);
     void clear();
 
-protected:
-    unsigned int mSize;
-    T* mBuffer;
-    volatile T*volatile mWrite;
-    volatile T*volatile mRead;
-    volatile int32_t mUsed;
+    // Zero copy access: the producer fills (up to) two regions in place and publishes them with commitWrite(),
+    // the consumer works on (up to) two regions in place and releases them with consume().
+    unsigned int reserveWrite(unsigned int len, Region& first, Region& second);
+    inline unsigned int commitWrite(unsigned int len) { return add(len); }
+    unsigned int peekRead(Region& first, Region& second);
+    inline unsigned int consume(unsigned int len) { return skip(len); }
 
-    unsigned int writePart(const T* data, unsigned int len);
-    unsigned int readPart(T *data, unsigned int len);
+protected:
+    volatile unsigned int mWrite;
+    volatile unsigned int mRead;
 
-    inline void align(volatile T*volatile& ptr) { while (ptr >= (mBuffer + mSize)) ptr -= mSize; }
+    inline unsigned int index(unsigned int position) const { return position & (this->capacity() - 1); }
 
     friend int testCircularBuffer();
 
 };
 
+template<typename T, unsigned int N>
+bool CircularBuffer<T, N>::push(T elem)
+{
+    unsigned int write = mWrite;
+    if (write - atomic_load_acquire(&mRead) == size()) return false;
+    this->buffer()[index(write)] = elem;
+    atomic_store_release(&mWrite, write + 1);
+    return true;
+}
+
+template<typename T, unsigned int N>
+bool CircularBuffer<T, N>::pop(T &elem)
+{
+    unsigned int read = mRead;
+    if (atomic_load_acquire(&mWrite) == read) return false;
+    elem = this->buffer()[index(read)];
+    atomic_store_release(&mRead, read + 1);
+    return true;
+}
+
+template<typename T, unsigned int N>
+bool CircularBuffer<T, N>::front(T& elem)
+{
+    if (free() == 0) return false;
+    elem = this->buffer()[index(mWrite)];
+    return true;
+}
+
+template<typename T, unsigned int N>
+bool CircularBuffer<T, N>::back(T &elem)
+{
+    if (used() == 0) return false;
+    elem = this->buffer()[index(mRead)];
+    return true;
+}
+
+template<typename T, unsigned int N>
+unsigned int CircularBuffer<T, N>::write(const T* data, unsigned int len)
+{
+    unsigned int write = mWrite;
+    len = std::min(len, size() - (write - atomic_load_acquire(&mRead)));
+    unsigned int start = index(write);
+    unsigned int partLen = std::min(len, size() - start);
+    std::memcpy(this->buffer() + start, data, partLen * sizeof(T));
+    std::memcpy(this->buffer(), data + partLen, (len - partLen) * sizeof(T));
+    atomic_store_release(&mWrite, write + len);
+    return len;
+}
+
+template<typename T, unsigned int N>
+unsigned int CircularBuffer<T, N>::read(T* data, unsigned int len)
+{
+    unsigned int read = mRead;
+    len = std::min(len, atomic_load_acquire(&mWrite) - read);
+    unsigned int start = index(read);
+    unsigned int partLen = std::min(len, size() - start);
+    std::memcpy(data, this->buffer() + start, partLen * sizeof(T));
+    std::memcpy(data + partLen, this->buffer(), (len - partLen) * sizeof(T));
+    atomic_store_release(&mRead, read + len);
+    return len;
+}
+
+template<typename T, unsigned int N>
+T CircularBuffer<T, N>::operator [](int index)
+{
+    if (index < 0) return this->buffer()[this->index(mWrite + index)];
+    return this->buffer()[this->index(mRead + index)];
+}
+
+template<typename T, unsigned int N>
+unsigned int CircularBuffer<T, N>::getContBuffer(const T *&data)
+{
+    unsigned int len = used();
+    if (len == 0) return 0;
+    unsigned int start = index(mRead);
+    data = this->buffer() + start;
+    return std::min(len, size() - start);
+}
+
+template<typename T, unsigned int N>
+unsigned int CircularBuffer<T, N>::skip(unsigned int len)
+{
+    unsigned int read = mRead;
+    len = std::min(len, atomic_load_acquire(&mWrite) - read);
+    atomic_store_release(&mRead, read + len);
+    return len;
+}
+
+template<typename T, unsigned int N>
+unsigned int CircularBuffer<T, N>::add(unsigned int len)
+{
+    unsigned int write = mWrite;
+    len = std::min(len, size() - (write - atomic_load_acquire(&mRead)));
+    atomic_store_release(&mWrite, write + len);
+    return len;
+}
+
+template<typename T, unsigned int N>
+unsigned int CircularBuffer<T, N>::reserveWrite(unsigned int len, Region& first, Region& second)
+{
+    unsigned int write = mWrite;
+    len = std::min(len, size() - (write - atomic_load_acquire(&mRead)));
+    unsigned int start = index(write);
+    first.data = this->buffer() + start;
+    first.len = std::min(len, size() - start);
+    second.data = this->buffer();
+    second.len = len - first.len;
+    return len;
+}
+
+template<typename T, unsigned int N>
+unsigned int CircularBuffer<T, N>::peekRead(Region& first, Region& second)
+{
+    unsigned int read = mRead;
+    unsigned int len = atomic_load_acquire(&mWrite) - read;
+    unsigned int start = index(read);
+    first.data = this->buffer() + start;
+    first.len = std::min(len, size() - start);
+    second.data = this->buffer();
+    second.len = len - first.len;
+    return len;
+}
+
+template<typename T, unsigned int N>
+void CircularBuffer<T, N>::clear()
+{
+    mWrite = mRead = 0;
+}
+
 #endif // CIRCULARBUFFER_H
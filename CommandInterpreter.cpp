@@ -24,7 +24,7 @@
 #include <strings.h>
 #include <stdio.h>
 
-CommandInterpreter::CommandInterpreter(Stream &serial) :
+CommandInterpreter::CommandInterpreter(Stream &serial, SysTickControl *sysTick) :
     mSerial(serial),
     mLineLen(0),
     mCurserPos(0),
@@ -32,14 +32,15 @@ CommandInterpreter::CommandInterpreter(Stream &serial) :
     mCommandTime(false),
     mReadChar(0),
     mCharReceived(*this),
-    mHistory(64),
     mHistoryIndex(0),
     mEscapeLen(0),
     mEscapeState(EscapeState::Ground),
     mFirstSpace(0),
     mFbIndex(0),
     mFbIndexOffset(1),
-    mTickEvent(*this, 40)
+    mTickEvent(*this, 40, System::Event::Priority::Low),
+    mSysTick(sysTick),
+    mRefresh(nullptr)
 {
     strcpy(mPrompt, "# ");
 }
@@ -276,7 +277,7 @@ void CommandInterpreter::start()
     {
         // Ignore any spurious characters that were sent during startup
     }
-    //mSystem.mSysTick.addRepeatingEvent(&mTickEvent);
+    if (mSysTick != nullptr) mSysTick->addRepeatingEvent(&mTickEvent);
     printLine();
 }
 
@@ -425,6 +426,17 @@ void CommandInterpreter::eventCallback(System::Event* event)
             printf("\nERROR: %s\n", s);
             printLine();
         }
+        if (mRefresh != nullptr)
+        {
+            // Any key stops the refresh, but doesn't end up in the command line.
+            mRefresh = nullptr;
+            while (mSerial.read(&mReadChar, 1, &mCharReceived) == 1)
+            {
+            }
+            printf("\x1b[2;1H\x1b[J");
+            printLine();
+            return;
+        }
         do
         {
             feed();
@@ -434,7 +446,7 @@ void CommandInterpreter::eventCallback(System::Event* event)
     {
         static unsigned int ps = -1;
         System* sys = System::instance();
-        unsigned int s = sys->ns() / 10000000000LU;
+        unsigned int s = sys->ns() / 1000000000LU;
         if (s != ps)
         {
             ps = s;
@@ -445,6 +457,7 @@ void CommandInterpreter::eventCallback(System::Event* event)
             printf("\x1b[s\x1b[;H%4u:%02u:%02u, %10lu.%03lus in %10lu Events, %10lu.%03lus in %10lu IRQs\x1b[K\x1b[u", s / 3600, (s / 60) % 60, s % 60,
                    te / 1000, te % 1000, ec,
                    ti / 1000, ti % 1000, ic);
+            if (mRefresh != nullptr) mRefresh->refresh(*this);
             fflush(nullptr);
         }
     }
@@ -625,11 +638,11 @@ void CommandInterpreter::execute()
     // Everything is fine, execute it.
     if (cmd != nullptr)
     {
-        uint64_t start = System::instance()->ns();
+        uint64_t start = System::instance()->timestamp();
         cmd->execute(*this, argc, mArguments);
         if (mCommandTime)
         {
-            uint64_t delta = System::instance()->ns() - start;
+            uint64_t delta = System::instance()->timestamp() - start;
             printf("Command took %u.%06us\n", static_cast<unsigned int>(delta / 1000000000), static_cast<unsigned int>((delta / 1000) % 1000000));
         }
     }
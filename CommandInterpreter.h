@@ -58,6 +58,8 @@ public:
 
         virtual bool execute(CommandInterpreter& interpreter, int argc, const Argument* mArguments) = 0;
         virtual const char* helpText() const = 0;
+        // Called about once a second after the command registered itself with setRefresh().
+        virtual void refresh(CommandInterpreter& /*interpreter*/) { }
 
     protected:
         char const *const * mAlias;
@@ -71,7 +73,8 @@ public:
     iterator begin() { return mCmd.begin(); }
     iterator end() { return mCmd.end(); }
 
-    CommandInterpreter(Stream& serial);
+    // With sysTick given, the status line and refreshing commands (see setRefresh()) are updated periodically.
+    CommandInterpreter(Stream& serial, SysTickControl* sysTick = nullptr);
     ~CommandInterpreter();
 
     void feed();
@@ -81,6 +84,10 @@ public:
     void printArguments(Command* cmd, bool summary);
     void printAliases(Command* cmd);
     bool parseArgument(Argument& argument);
+    // The refresh stops with the next key pressed.
+    void setRefresh(Command* cmd) { mRefresh = cmd; }
+
+    virtual const char* name() const { return "cli"; }
 protected:
     virtual void eventCallback(System::Event *event);
 private:
@@ -119,7 +126,7 @@ private:
     bool mCommandTime;
     char mReadChar;
     System::Event mCharReceived;
-    CircularBuffer<char*> mHistory;
+    CircularBuffer<char*, 64> mHistory;
     int mHistoryIndex;
     char mEscape[MAX_ESCAPE_LEN];
     int mEscapeLen;
@@ -129,6 +136,8 @@ private:
     int mFbIndex;
     int mFbIndexOffset;
     SysTickControl::RepeatingEvent mTickEvent;
+    SysTickControl* mSysTick;
+    Command* mRefresh;
 
 
     void printLine();
@@ -1,5 +1,6 @@
 #include "Commands.h"
 
+#include <algorithm>
 #include <cmath>
 #include <strings.h>
 
@@ -20,6 +21,24 @@ char const * const CmdPin::ARGV[] = { "Pos:pin", "Vob:value" };
 
 char const * const CmdMeasureClock::NAME[] = { "clock" };
 
+char const * const CmdThreads::NAME[] = { "threads" };
+
+char const * const CmdIrqStat::NAME[] = { "irqstat" };
+char const * const CmdIrqStat::ARGV[] = { "os:reset" };
+
+char const * const CmdTop::NAME[] = { "top" };
+char const * const CmdTop::ARGV[] = { "os:reset" };
+
+char const * const CmdBench::NAME[] = { "bench" };
+char const * const CmdBench::ARGV[] = { "s:memcpy" };
+
+char const * const CmdDmaStat::NAME[] = { "dmastat" };
+char const * const CmdDmaStat::ARGV[] = { "os:reset" };
+
+char const * const CmdBaud::NAME[] = { "baud" };
+char const * const CmdBaud::ARGV[] = { "ou:speed" };
+const uint32_t CmdBaud::SPEED[] = { 9600, 19200, 38400, 57600, 115200, 230400, 460800, 921600, 1000000, 2000000, 3000000, 4000000, 6000000, 8000000, 10000000, 12000000 };
+
 
 CmdHelp::CmdHelp() : Command(NAME, sizeof(NAME) / sizeof(NAME[0]), ARGV, sizeof(ARGV) / sizeof(ARGV[0]))
 {
@@ -56,7 +75,15 @@ CmdInfo::CmdInfo(System &system) : Command(NAME, sizeof(NAME) / sizeof(NAME[0]),
 
 bool CmdInfo::execute(CommandInterpreter &interpreter, int argc, const CommandInterpreter::Argument *argv)
 {
+    static const char* const PRIORITY_NAME[System::Event::PRIORITY_COUNT] = { "high", "normal", "low" };
     mSystem.printInfo();
+    printf("QUEUES  :");
+    for (int i = 0; i < System::Event::PRIORITY_COUNT; ++i)
+    {
+        System::Event::Priority priority = static_cast<System::Event::Priority>(i);
+        printf(" %s %u/%u", PRIORITY_NAME[i], mSystem.eventQueueHighWater(priority), mSystem.eventQueueSize(priority));
+    }
+    printf(" max used.\n");
     return true;
 }
 
@@ -404,3 +431,241 @@ void CmdMeasureClock::eventCallback(System::Event */*event*/)
 
 
 
+
+CmdIrqStat::CmdIrqStat(System &system) : Command(NAME, sizeof(NAME) / sizeof(NAME[0]), ARGV, sizeof(ARGV) / sizeof(ARGV[0])), mSystem(system)
+{
+}
+
+bool CmdIrqStat::execute(CommandInterpreter &/*interpreter*/, int argc, const CommandInterpreter::Argument *argv)
+{
+#ifdef IRQ_STATISTICS
+    if (argc == 2)
+    {
+        if (strcmp(argv[1].value.s, "reset") != 0) return false;
+        mSystem.resetInterruptStatistics();
+        return true;
+    }
+    printf("VECTOR       COUNT     TOTAL       AVG       MAX   LAT AVG   LAT MAX\n");
+    for (unsigned int i = 0; i < System::VECTOR_COUNT; ++i)
+    {
+        const System::InterruptStatistics& stat = mSystem.interruptStatistics(i);
+        if (stat.count == 0) continue;
+        if (i == 15) printf("SysTick ");
+        else if (i < 16) printf("EXC %-3u ", i);
+        else printf("IRQ %-3u ", i - 16);
+        printf("%10lu", stat.count);
+        printDuration(stat.total);
+        printDuration(stat.total / stat.count);
+        printDuration(stat.max);
+        if (stat.latencyCount != 0)
+        {
+            printDuration(stat.latencyTotal / stat.latencyCount);
+            printDuration(stat.latencyMax);
+        }
+        printf("\n       ");
+        for (unsigned int bucket = 0; bucket < System::InterruptStatistics::HISTOGRAM_SIZE; ++bucket)
+        {
+            if (stat.histogram[bucket] == 0) continue;
+            if (bucket == System::InterruptStatistics::HISTOGRAM_SIZE - 1) printf(" >=");
+            else printf(" <");
+            printDuration(1ULL << (bucket == System::InterruptStatistics::HISTOGRAM_SIZE - 1 ? bucket + 6 : bucket + 7));
+            printf(": %lu", stat.histogram[bucket]);
+        }
+        printf("\n");
+    }
+    return true;
+#else
+    (void)argc;
+    (void)argv;
+    printf("Interrupt statistics are not available, build with IRQ_STATISTICS.\n");
+    return true;
+#endif
+}
+
+void CmdIrqStat::printDuration(uint64_t ns)
+{
+    if (ns < 10000) printf(" %6luns", static_cast<unsigned long>(ns));
+    else if (ns < 10000000) printf(" %6luus", static_cast<unsigned long>(ns / 1000));
+    else printf(" %6lums", static_cast<unsigned long>(ns / 1000000));
+}
+
+CmdTop::CmdTop(System &system) : Command(NAME, sizeof(NAME) / sizeof(NAME[0]), ARGV, sizeof(ARGV) / sizeof(ARGV[0])), mSystem(system)
+{
+}
+
+bool CmdTop::execute(CommandInterpreter &interpreter, int argc, const CommandInterpreter::Argument *argv)
+{
+#ifdef EVENT_STATISTICS
+    if (argc == 2)
+    {
+        if (strcmp(argv[1].value.s, "reset") != 0) return false;
+        mSystem.resetCallbackStatistics();
+        return true;
+    }
+    refresh(interpreter);
+    interpreter.setRefresh(this);
+    return true;
+#else
+    (void)interpreter;
+    (void)argc;
+    (void)argv;
+    printf("Event statistics are not available, build with EVENT_STATISTICS.\n");
+    return true;
+#endif
+}
+
+void CmdTop::refresh(CommandInterpreter &/*interpreter*/)
+{
+#ifdef EVENT_STATISTICS
+    enum { MAX_LINES = 20 };
+    const System::CallbackStatistics* stats = mSystem.callbackStatistics();
+    const System::CallbackStatistics* sorted[System::CALLBACK_STATISTICS_SIZE];
+    unsigned int count = 0;
+    for (unsigned int i = 0; i < System::CALLBACK_STATISTICS_SIZE; ++i)
+    {
+        if (stats[i].callback != nullptr) sorted[count++] = &stats[i];
+    }
+    std::sort(sorted, sorted + count, [](const System::CallbackStatistics* a, const System::CallbackStatistics* b) { return a->total > b->total; });
+
+    // Below the status line
+    printf("\x1b[2;1H\x1b[J%-20s %10s %12s %10s %10s\n", "CALLBACK", "COUNT", "TOTAL [us]", "AVG [us]", "MAX [us]");
+    for (unsigned int i = 0; i < count && i < MAX_LINES; ++i)
+    {
+        const System::CallbackStatistics* stat = sorted[i];
+        const char* name = stat->callback->name();
+        if (name != nullptr) printf("%-20s", name);
+        else printf("%-20p", static_cast<void*>(stat->callback));
+        printf(" %10lu %12lu %10lu %10lu\n", stat->count, static_cast<unsigned long>(stat->total / 1000),
+               static_cast<unsigned long>(stat->total / stat->count / 1000), stat->max / 1000);
+    }
+    if (mSystem.callbackStatisticsLost() != 0) printf("%lu calls not recorded (table full).\n", mSystem.callbackStatisticsLost());
+#endif
+}
+
+CmdThreads::CmdThreads(Kernel &kernel) : Command(NAME, sizeof(NAME) / sizeof(NAME[0]), nullptr, 0), mKernel(kernel)
+{
+}
+
+bool CmdThreads::execute(CommandInterpreter &/*interpreter*/, int /*argc*/, const CommandInterpreter::Argument */*argv*/)
+{
+    static const char* const STATE_NAME[] = { "ready", "blocked", "finished" };
+    uint64_t total = mKernel.timeSinceStart();
+    if (total == 0) total = 1;
+    printf("%-12s %10s %-8s %10s %6s %12s\n", "NAME", "PRIO", "STATE", "CPU [ms]", "CPU", "STACK");
+    for (Kernel::Thread* thread = mKernel.threads(); thread != nullptr; thread = mKernel.next(thread))
+    {
+        uint64_t cpuTime = mKernel.cpuTime(thread);
+        printf("%-12s %4u (%3u) %-8s %10lu %5lu%% %5u/%-6u\n", thread->name(), thread->basePriority(), thread->priority(), STATE_NAME[static_cast<int>(thread->state())],
+               static_cast<unsigned long>(cpuTime / 1000000), static_cast<unsigned long>(cpuTime * 100 / total), thread->stackMaxUsed(), thread->stackSize());
+    }
+    printf("Handler stack: %u bytes max used.\n", mKernel.handlerStackMaxUsed());
+    return true;
+}
+
+CmdBench::CmdBench(DmaMemcpy &dmaMemcpy) : Command(NAME, sizeof(NAME) / sizeof(NAME[0]), ARGV, sizeof(ARGV) / sizeof(ARGV[0])), mDmaMemcpy(dmaMemcpy)
+{
+}
+
+bool CmdBench::execute(CommandInterpreter &/*interpreter*/, int /*argc*/, const CommandInterpreter::Argument *argv)
+{
+    static const unsigned int SIZE[] = { 16, 32, 64, 128, 256, 512, 1024, 4096, 16384 };
+    static const unsigned int MAX_SIZE = 16384;
+    static const unsigned int REPEAT = 8;
+    if (strcmp(argv[1].value.s, "memcpy") != 0) return false;
+
+    uint32_t* src = new uint32_t[MAX_SIZE / sizeof(uint32_t)];
+    uint32_t* dst = new uint32_t[MAX_SIZE / sizeof(uint32_t)];
+    memset(src, 0x55, MAX_SIZE);
+    unsigned int threshold = mDmaMemcpy.cpuThreshold();
+    mDmaMemcpy.setCpuThreshold(0);
+    unsigned int crossover = 0;
+    System* system = System::instance();
+    printf("   SIZE   CPU [MB/s]   DMA [MB/s]\n");
+    for (unsigned int size : SIZE)
+    {
+        uint64_t start = system->timestamp();
+        for (unsigned int i = 0; i < REPEAT; ++i) memcpy(dst, src, size);
+        uint64_t cpu = system->timestamp() - start;
+        start = system->timestamp();
+        for (unsigned int i = 0; i < REPEAT; ++i) mDmaMemcpy.copyWait(dst, src, size);
+        uint64_t dma = system->timestamp() - start;
+        if (cpu == 0) cpu = 1;
+        if (dma == 0) dma = 1;
+        // bytes per ns are GB/s, so scale by 1000 for MB/s.
+        printf("%7u %12lu %12lu\n", size, static_cast<unsigned long>(1000ULL * size * REPEAT / cpu), static_cast<unsigned long>(1000ULL * size * REPEAT / dma));
+        if (dma < cpu && crossover == 0) crossover = size;
+        else if (dma >= cpu) crossover = 0;
+    }
+    delete[] dst;
+    delete[] src;
+    if (crossover != 0)
+    {
+        mDmaMemcpy.setCpuThreshold(crossover);
+        printf("DMA is faster from %u bytes on, threshold set.\n", crossover);
+    }
+    else
+    {
+        mDmaMemcpy.setCpuThreshold(threshold);
+        printf("DMA is never faster, threshold left at %u bytes.\n", threshold);
+    }
+    return true;
+}
+
+CmdDmaStat::CmdDmaStat(DmaManager &dmaManager) : Command(NAME, sizeof(NAME) / sizeof(NAME[0]), ARGV, sizeof(ARGV) / sizeof(ARGV[0])), mDmaManager(dmaManager)
+{
+}
+
+bool CmdDmaStat::execute(CommandInterpreter &/*interpreter*/, int argc, const CommandInterpreter::Argument *argv)
+{
+    if (argc == 2)
+    {
+        if (strcmp(argv[1].value.s, "reset") != 0) return false;
+        mDmaManager.resetStatistics();
+        return true;
+    }
+    uint64_t total = mDmaManager.timeSinceReset();
+    if (total == 0) total = 1;
+    printf("STREAM       ACQUIRED   BUSY [ms]   USE  STATE\n");
+    for (unsigned int controller = 0; controller < DmaManager::CONTROLLER_COUNT; ++controller)
+    {
+        for (unsigned int index = 0; index < DmaManager::STREAM_COUNT; ++index)
+        {
+            if (mDmaManager.stream(controller, index) == nullptr) continue;
+            const DmaManager::Statistics& stat = mDmaManager.statistics(controller, index);
+            printf("DMA%u S%u  %12lu %11lu %4lu%%  %s\n", controller + 1, index, static_cast<unsigned long>(stat.acquired), static_cast<unsigned long>(stat.busyTime / 1000000),
+                   static_cast<unsigned long>(stat.busyTime * 100 / total), mDmaManager.busy(controller, index) ? "busy" : "free");
+        }
+    }
+    printf("Requests without a free stream: %lu\n", static_cast<unsigned long>(mDmaManager.refused()));
+    return true;
+}
+
+CmdBaud::CmdBaud(ClockControl &clockControl) : Command(NAME, sizeof(NAME) / sizeof(NAME[0]), ARGV, sizeof(ARGV) / sizeof(ARGV[0])), mClockControl(clockControl)
+{
+}
+
+bool CmdBaud::execute(CommandInterpreter &/*interpreter*/, int argc, const CommandInterpreter::Argument *argv)
+{
+    uint32_t apb1 = mClockControl.clock(ClockControl::ClockSpeed::APB1);
+    uint32_t apb2 = mClockControl.clock(ClockControl::ClockSpeed::APB2);
+    if (argc == 2 && argv[1].value.u == 0) return false;
+    printf("    SPEED  APB1 %3luMHz            APB2 %3luMHz\n", static_cast<unsigned long>(apb1 / 1000000), static_cast<unsigned long>(apb2 / 1000000));
+    unsigned int count = argc == 2 ? 1 : sizeof(SPEED) / sizeof(SPEED[0]);
+    for (unsigned int i = 0; i < count; ++i)
+    {
+        uint32_t speed = argc == 2 ? argv[1].value.u : SPEED[i];
+        printf("%9lu", static_cast<unsigned long>(speed));
+        printBaud(apb1, speed);
+        printBaud(apb2, speed);
+        printf("\n");
+    }
+    printf("Maximum: APB1 %lu, APB2 %lu with 8x oversampling.\n", static_cast<unsigned long>(apb1 / 8), static_cast<unsigned long>(apb2 / 8));
+    return true;
+}
+
+void CmdBaud::printBaud(uint32_t clock, uint32_t speed)
+{
+    Serial::Baud baud = Serial::calculate(clock, speed);
+    unsigned long error = static_cast<unsigned long>(std::abs(baud.errorPpm));
+    printf("  %9lu %3s %c%2lu.%02lu%%", static_cast<unsigned long>(baud.speed), baud.over8 ? "x8" : "x16", baud.errorPpm < 0 ? '-' : '+', error / 10000, error / 100 % 100);
+}
@@ -5,6 +5,10 @@
 #include "System.h"
 #include "Gpio.h"
 #include "Timer.h"
+#include "Kernel.h"
+#include "DmaMemcpy.h"
+#include "DmaManager.h"
+#include "Serial.h"
 
 #include <cstdio>
 #include <vector>
@@ -92,6 +96,7 @@ public:
     CmdMeasureClock(ClockControl& clockControl, Timer& timer5);
     virtual bool execute(CommandInterpreter& interpreter, int argc, const CommandInterpreter::Argument* argv);
     virtual const char* helpText() const { return "Measure external clock (HSE)."; }
+    virtual const char* name() const { return "clock"; }
 protected:
     virtual void eventCallback(System::Event* event);
 private:
@@ -103,4 +108,81 @@ private:
     unsigned mCount;
 };
 
+class CmdIrqStat : public CommandInterpreter::Command
+{
+public:
+    CmdIrqStat(System& system);
+    virtual bool execute(CommandInterpreter& interpreter, int argc, const CommandInterpreter::Argument* argv);
+    virtual const char* helpText() const { return "Shows per interrupt statistics (count, duration, latency), \"reset\" clears them."; }
+private:
+    static char const * const NAME[];
+    static char const * const ARGV[];
+    System& mSystem;
+
+    void printDuration(uint64_t ns);
+};
+
+class CmdTop : public CommandInterpreter::Command
+{
+public:
+    CmdTop(System& system);
+    virtual bool execute(CommandInterpreter& interpreter, int argc, const CommandInterpreter::Argument* argv);
+    virtual const char* helpText() const { return "Shows the event callbacks using the most time until a key is pressed, \"reset\" clears the statistics."; }
+    virtual void refresh(CommandInterpreter& interpreter);
+private:
+    static char const * const NAME[];
+    static char const * const ARGV[];
+    System& mSystem;
+};
+
+class CmdThreads : public CommandInterpreter::Command
+{
+public:
+    CmdThreads(Kernel& kernel);
+    virtual bool execute(CommandInterpreter& interpreter, int argc, const CommandInterpreter::Argument* argv);
+    virtual const char* helpText() const { return "Shows CPU time and stack usage of all threads."; }
+private:
+    static char const * const NAME[];
+    Kernel& mKernel;
+};
+
+class CmdBench : public CommandInterpreter::Command
+{
+public:
+    CmdBench(DmaMemcpy& dmaMemcpy);
+    virtual bool execute(CommandInterpreter& interpreter, int argc, const CommandInterpreter::Argument* argv);
+    virtual const char* helpText() const { return "Compares CPU and DMA memcpy throughput and sets the DMA threshold accordingly."; }
+private:
+    static char const * const NAME[];
+    static char const * const ARGV[];
+    DmaMemcpy& mDmaMemcpy;
+};
+
+class CmdDmaStat : public CommandInterpreter::Command
+{
+public:
+    CmdDmaStat(DmaManager& dmaManager);
+    virtual bool execute(CommandInterpreter& interpreter, int argc, const CommandInterpreter::Argument* argv);
+    virtual const char* helpText() const { return "Shows use of the DMA streams handed out by the manager, \"reset\" clears the statistics."; }
+private:
+    static char const * const NAME[];
+    static char const * const ARGV[];
+    DmaManager& mDmaManager;
+};
+
+class CmdBaud : public CommandInterpreter::Command
+{
+public:
+    CmdBaud(ClockControl& clockControl);
+    virtual bool execute(CommandInterpreter& interpreter, int argc, const CommandInterpreter::Argument* argv);
+    virtual const char* helpText() const { return "Shows the achievable serial speeds and their error for the current APB clocks, or just for the speed given."; }
+private:
+    static char const * const NAME[];
+    static char const * const ARGV[];
+    static const uint32_t SPEED[];
+    ClockControl& mClockControl;
+
+    void printBaud(uint32_t clock, uint32_t speed);
+};
+
 #endif // COMMANDS_H
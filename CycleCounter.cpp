@@ -0,0 +1,68 @@
+/*
+ * (c) 2012 Thomas Wihl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "CycleCounter.h"
+
+CycleCounter::CycleCounter(System::BaseAddress dwt, System::BaseAddress demcr, ClockControl *clock) :
+    mBase(reinterpret_cast<volatile DWT*>(dwt)),
+    mClock(clock),
+    mAvailable(false),
+    mLast(0),
+    mHigh(0),
+    mMul(0),
+    mBaseCycles(0),
+    mBaseNs(0)
+{
+    static_assert(sizeof(DWT) == 0x8, "Struct has wrong size, compiler problem.");
+    volatile uint32_t* demcrReg = reinterpret_cast<volatile uint32_t*>(demcr);
+    *demcrReg = *demcrReg | DEMCR_TRCENA;
+    // Writes are ignored if there is no lock
+    *reinterpret_cast<volatile uint32_t*>(dwt + LAR_OFFSET) = LAR_UNLOCK;
+    mAvailable = !mBase->CTRL.NOCYCCNT;
+    if (!mAvailable) return;
+    mBase->CYCCNT = 0;
+    mBase->CTRL.CYCCNTENA = 1;
+    setClock(mClock->clock(ClockControl::ClockSpeed::System));
+    mClock->addChangeHandler(this);
+}
+
+CycleCounter::~CycleCounter()
+{
+    if (mAvailable) mClock->removeChangeHandler(this);
+}
+
+// The time up to a clock change is folded into mBaseNs, so the conversion only ever uses one clock.
+void CycleCounter::clockCallback(ClockControl::Callback::Reason reason, uint32_t clock)
+{
+    if (reason == ClockControl::Callback::Reason::AboutToChange)
+    {
+        mBaseNs = ns();
+        mBaseCycles = cycles();
+    }
+    else
+    {
+        setClock(clock);
+    }
+}
+
+void CycleCounter::setClock(uint32_t clock)
+{
+    mBaseNs = ns();
+    mBaseCycles = cycles();
+    mMul = (static_cast<uint64_t>(1000000000) << SHIFT) / clock;
+}
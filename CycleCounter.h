@@ -0,0 +1,108 @@
+/*
+ * (c) 2012 Thomas Wihl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef CYCLECOUNTER_H
+#define CYCLECOUNTER_H
+
+#include "System.h"
+#include "ClockControl.h"
+#include "atomic.h"
+
+// Time base using the cycle counter of the data watchpoint and trace unit (DWT), extended to 64 bit.
+// It has to be read at least once per counter wrap (about 20s at 216MHz), System does so on every interrupt.
+// The counter doesn't run while the core sleeps, so only use it to measure times spent running.
+class CycleCounter : public ClockControl::Callback
+{
+public:
+    CycleCounter(System::BaseAddress dwt, System::BaseAddress demcr, ClockControl* clock);
+    ~CycleCounter();
+
+    bool available() const { return mAvailable; }
+
+    inline uint64_t cycles()
+    {
+        unsigned int primask = interrupt_disable();
+        uint32_t count = mBase->CYCCNT;
+        if (count < mLast) mHigh += static_cast<uint64_t>(1) << 32;
+        mLast = count;
+        uint64_t cycles = mHigh | count;
+        interrupt_restore(primask);
+        return cycles;
+    }
+
+    inline uint64_t ns()
+    {
+        uint64_t delta = cycles() - mBaseCycles;
+        // ns = cycles * mMul / 2^SHIFT, split into two 32x32 bit multiplications so nothing overflows.
+        uint32_t hi = delta >> 32;
+        return mBaseNs + ((static_cast<uint32_t>(delta) * static_cast<uint64_t>(mMul)) >> SHIFT) + ((hi * static_cast<uint64_t>(mMul)) << (32 - SHIFT));
+    }
+
+protected:
+    virtual void clockCallback(ClockControl::Callback::Reason reason, uint32_t clock);
+
+private:
+    // Gives us a precision of 1e-8 for clocks down to 4MHz, where mMul still fits into 32 bit.
+    static const unsigned int SHIFT = 24;
+
+    struct DWT
+    {
+        struct __CTRL
+        {
+            uint32_t CYCCNTENA : 1;
+            uint32_t POSTPRESET : 4;
+            uint32_t POSTINIT : 4;
+            uint32_t CYCTAP : 1;
+            uint32_t SYNCTAP : 2;
+            uint32_t PCSAMPLENA : 1;
+            uint32_t __RESERVED0 : 3;
+            uint32_t EXCTRCENA : 1;
+            uint32_t CPIEVTENA : 1;
+            uint32_t EXCEVTENA : 1;
+            uint32_t SLEEPEVTENA : 1;
+            uint32_t LSUEVTENA : 1;
+            uint32_t FOLDEVTENA : 1;
+            uint32_t CYCEVTENA : 1;
+            uint32_t __RESERVED1 : 1;
+            uint32_t NOPRFCNT : 1;
+            uint32_t NOCYCCNT : 1;
+            uint32_t NOEXTTRIG : 1;
+            uint32_t NOTRCPKT : 1;
+            uint32_t NUMCOMP : 4;
+        }   CTRL;
+        uint32_t CYCCNT;
+    };
+    // Debug exception and monitor control register, TRCENA enables DWT and ITM.
+    static const uint32_t DEMCR_TRCENA = 1 << 24;
+    // Software lock of the DWT, needs to be unlocked on the Cortex-M7
+    static const uint32_t LAR_OFFSET = 0xfb0;
+    static const uint32_t LAR_UNLOCK = 0xc5acce55;
+
+    volatile DWT* mBase;
+    ClockControl* mClock;
+    bool mAvailable;
+    uint32_t mLast;
+    uint64_t mHigh;
+    uint32_t mMul;
+    uint64_t mBaseCycles;
+    uint64_t mBaseNs;
+
+    void setClock(uint32_t clock);
+};
+
+#endif // CYCLECOUNTER_H
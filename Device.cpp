@@ -19,8 +19,10 @@
 #include "Device.h"
 
 Device::Device() :
+    mInterrupt(nullptr),
     mDmaWrite(nullptr),
-    mDmaRead(nullptr)
+    mDmaRead(nullptr),
+    mDmaManager(nullptr)
 {
 
 }
@@ -39,6 +41,43 @@ void Device::configDma(Dma::Stream *write, Dma::Stream *read)
     }
 }
 
+void Device::configDma(DmaManager *manager, DmaManager::Request write, DmaManager::Request read, Dma::Stream::Priority priority)
+{
+    mDmaManager = manager;
+    mDmaWriteRequest = write;
+    mDmaReadRequest = read;
+    mDmaPriority = priority;
+}
+
+bool Device::acquireDma(bool write, bool read)
+{
+    if (mDmaManager == nullptr) return (!write || mDmaWrite != nullptr) && (!read || mDmaRead != nullptr);
+    Dma::Stream* writeStream = nullptr;
+    Dma::Stream* readStream = nullptr;
+    bool writeChanged = false;
+    bool readChanged = false;
+    if (write && (writeStream = mDmaManager->acquire(mDmaWriteRequest, mDmaPriority, this, writeChanged)) == nullptr) return false;
+    if (read && (readStream = mDmaManager->acquire(mDmaReadRequest, mDmaPriority, this, readChanged)) == nullptr)
+    {
+        if (writeStream != nullptr) mDmaManager->release(writeStream);
+        return false;
+    }
+    // Streams we had last keep our settings, the device only configures them when they come from someone else.
+    if (writeChanged || readChanged) configDma(writeStream, readStream);
+    else Device::configDma(writeStream, readStream);
+    return true;
+}
+
+void Device::releaseDma()
+{
+    if (mDmaManager == nullptr) return;
+    Dma::Stream* writeStream = mDmaWrite;
+    Dma::Stream* readStream = mDmaRead;
+    Device::configDma(nullptr, nullptr);
+    if (writeStream != nullptr) mDmaManager->release(writeStream);
+    if (readStream != nullptr) mDmaManager->release(readStream);
+}
+
 void Device::configInterrupt(InterruptController::Line* interrupt)
 {
     mInterrupt = interrupt;
@@ -58,7 +97,8 @@ void Device::dmaCallback(Dma::Stream* stream, Dma::Stream::Callback::Reason reas
         else
         {
             // Ooops something went wrong (probably our configuration, anyway, disable DMA.
-            configDma(nullptr, mDmaRead);
+            if (mDmaManager != nullptr) releaseDma();
+            else configDma(nullptr, mDmaRead);
             System::instance()->printError("Device", "DMA write transfer failed");
         }
 
@@ -70,7 +110,8 @@ void Device::dmaCallback(Dma::Stream* stream, Dma::Stream::Callback::Reason reas
         else
         {
             // Ooops something went wrong (probably our configuration, anyway, disable DMA.
-            configDma(mDmaWrite, nullptr);
+            if (mDmaManager != nullptr) releaseDma();
+            else configDma(mDmaWrite, nullptr);
             System::instance()->printError("Device", "DMA read transfer failed");
         }
     }
@@ -21,6 +21,7 @@
 
 #include "System.h"
 #include "Dma.h"
+#include "DmaManager.h"
 
 class Device : public Dma::Stream::Callback, public InterruptController::Callback
 {
@@ -37,6 +38,10 @@ public:
     virtual void dmaWriteHalfComplete() { }
 
     virtual void configDma(Dma::Stream* write, Dma::Stream* read);
+    // Takes the streams from the manager per transfer, see acquireDma(). Only for devices that bracket their
+    // transfers with acquireDma() and releaseDma(), for now Spi. Serial keeps its streams for good, the circular
+    // receive DMA of Stream never stops, I2C has no transfer without DMA to fall back to.
+    void configDma(DmaManager* manager, DmaManager::Request write, DmaManager::Request read, Dma::Stream::Priority priority = Dma::Stream::Priority::Medium);
     virtual void configInterrupt(InterruptController::Line* interrupt);
 
 protected:
@@ -45,6 +50,17 @@ protected:
     Dma::Stream* mDmaRead;
 
     virtual void dmaCallback(Dma::Stream* stream, Dma::Stream::Callback::Reason reason);
+    // With a manager, gets the streams for the next transfer, false if not all of them are free. The virtual
+    // configDma() only runs if a stream served another device or request since we had it.
+    // Without, it just tells if the fixed streams are configured.
+    bool acquireDma(bool write, bool read);
+    void releaseDma();
+
+private:
+    DmaManager* mDmaManager;
+    DmaManager::Request mDmaWriteRequest;
+    DmaManager::Request mDmaReadRequest;
+    Dma::Stream::Priority mDmaPriority;
 
 
 };
@@ -17,6 +17,7 @@
  */
 
 #include "Dma.h"
+#include "CacheControl.h"
 
 Dma::Dma(unsigned int base) :
     mBase(reinterpret_cast<volatile DMA*>(base))
@@ -64,7 +65,12 @@ Dma::Stream::Stream(Dma &dma, Dma::Stream::StreamIndex stream, Dma::Stream::Chan
     mPeripheral(0),
     mMemory0(0),
     mMemory1(0),
-    mCount(0)
+    mCount(0),
+    mCompletedBuffer(End::Memory0),
+    mChain(nullptr),
+    mChainStart(nullptr),
+    mChainRemaining(0),
+    mAutoOptimize(false)
 {
     mStreamConfig.CR = 0;
     mStreamConfig.BITS.CHSEL = mChannel;
@@ -86,9 +92,12 @@ Dma::Stream::~Stream()
     mDma.mBase->STREAM[mStream].CR.BITS.EN = 0;
 }
 
-void Dma::Stream::start()
+bool Dma::Stream::start()
 {
-    waitReady();
+    if (!waitReady()) return false;
+    if (mAutoOptimize && mStreamConfig.BITS.MINC) optimize();
+    prepareCache(mMemory0, mCount, mStreamConfig.BITS.MINC);
+    if (mStreamConfig.BITS.DBM) prepareCache(mMemory1, mCount, mStreamConfig.BITS.MINC);
     mDma.mBase->STREAM[mStream].M0AR = mMemory0;
     mDma.mBase->STREAM[mStream].M1AR = mMemory1;
     mDma.mBase->STREAM[mStream].PAR = mPeripheral;
@@ -96,15 +105,114 @@ void Dma::Stream::start()
     mDma.mBase->STREAM[mStream].FCR.FCR = mFifoConfig.FCR;
     mDma.mBase->STREAM[mStream].CR.CR = mStreamConfig.CR;
     mDma.mBase->STREAM[mStream].CR.BITS.EN = 1;
+    return true;
 }
 
-void Dma::Stream::waitReady()
+// The memory side moves the widest unit address and length are aligned to, in the longest burst up to the FIFO size
+// of 16 bytes. Aligned bursts never cross a 1KB boundary and a whole number of them fill the FIFO threshold.
+void Dma::Stream::optimize()
 {
-    if (mDma.mBase->STREAM[mStream].CR.BITS.EN)
+    unsigned int bytes = mCount << mStreamConfig.BITS.PSIZE;
+    uint32_t alignment = mMemory0 | bytes;
+    if (mStreamConfig.BITS.DBM) alignment |= mMemory1;
+    unsigned int size = 4;
+    while (size > 1 && (alignment & (size - 1)) != 0) size >>= 1;
+    unsigned int burst = 16;
+    while (burst > size && (alignment & (burst - 1)) != 0) burst >>= 1;
+    // There are no bursts of two beats.
+    if (burst == 2 * size) burst = size;
+    unsigned int beats = burst / size;
+    mStreamConfig.BITS.MSIZE = size >> 1;
+    mStreamConfig.BITS.MBURST = beats == 16 ? 3 : (beats == 8 ? 2 : (beats == 4 ? 1 : 0));
+    mFifoConfig.BITS.DMDIS = 1;
+    if (burst == 16) mFifoConfig.BITS.FTH = static_cast<uint32_t>(FifoThreshold::Full);
+    else if (burst == 8) mFifoConfig.BITS.FTH = static_cast<uint32_t>(FifoThreshold::Half);
+    else mFifoConfig.BITS.FTH = static_cast<uint32_t>(FifoThreshold::Quater);
+}
+
+bool Dma::Stream::startChain(const Dma::Stream::Segment *segments, unsigned int count)
+{
+    if (count == 0) return true;
+    if (!waitReady()) return false;
+    for (unsigned int i = 0; i < count; ++i) prepareCache(segments[i].memory, segments[i].count, segments[i].memoryIncrement);
+    mChain = segments;
+    mChainStart = segments;
+    mChainRemaining = count;
+    mDma.mBase->STREAM[mStream].PAR = mPeripheral;
+    mDma.mBase->STREAM[mStream].FCR.FCR = mFifoConfig.FCR;
+    startSegment();
+    return true;
+}
+
+// Kept short, it runs between two segments of a chain.
+void Dma::Stream::startSegment()
+{
+    volatile __STREAM& stream = mDma.mBase->STREAM[mStream];
+    mStreamConfig.BITS.MINC = mChain->memoryIncrement ? 1 : 0;
+    stream.M0AR = mChain->memory;
+    stream.NDTR = mChain->count;
+    stream.CR.CR = mStreamConfig.CR | 1;
+}
+
+// The memory a DMA reads gets written back from the data cache. The memory it writes too, so no dirty line can be
+// evicted on top of the new data later, and is dropped from the cache.
+void Dma::Stream::prepareCache(System::BaseAddress memory, uint16_t count, bool increment)
+{
+    unsigned int bytes = increment ? count << mStreamConfig.BITS.PSIZE : 1 << mStreamConfig.BITS.MSIZE;
+    Direction direction = static_cast<Direction>(mStreamConfig.BITS.DIR);
+    if (direction == Direction::MemoryToPeripheral)
+    {
+        CacheControl::clean(memory, bytes);
+        return;
+    }
+    if (direction == Direction::MemoryToMemory)
+    {
+        CacheControl::clean(mPeripheral, mStreamConfig.BITS.PINC ? count << mStreamConfig.BITS.PSIZE : 1 << mStreamConfig.BITS.PSIZE);
+    }
+    CacheControl::cleanInvalidate(memory, bytes);
+}
+
+// Drops lines the CPU might have fetched by speculation while the DMA wrote the memory.
+// Lines only partly covered by the buffer may hold data the CPU wrote next to it meanwhile, they get cleaned as
+// well so it isn't dropped. See setAddress() for the price of that.
+void Dma::Stream::completeCache(System::BaseAddress memory, uint16_t count, bool increment)
+{
+    if (static_cast<Direction>(mStreamConfig.BITS.DIR) == Direction::MemoryToPeripheral) return;
+    unsigned int bytes = increment ? count << mStreamConfig.BITS.PSIZE : 1 << mStreamConfig.BITS.MSIZE;
+    System::BaseAddress end = memory + bytes;
+    System::BaseAddress first = (memory + CacheControl::LINE_SIZE - 1) & ~static_cast<System::BaseAddress>(CacheControl::LINE_SIZE - 1);
+    System::BaseAddress last = end & ~static_cast<System::BaseAddress>(CacheControl::LINE_SIZE - 1);
+    if (first >= last)
+    {
+        CacheControl::cleanInvalidate(memory, bytes);
+        return;
+    }
+    if (memory != first) CacheControl::cleanInvalidate(memory, first - memory);
+    CacheControl::invalidate(first, last - first);
+    if (end != last) CacheControl::cleanInvalidate(last, end - last);
+}
+
+// A running transfer is stopped, EN reads back as 0 once the current data item is through, a few bus cycles later.
+// Only spins, this is called from interrupt handlers and must not run the event loop.
+bool Dma::Stream::waitReady()
+{
+    volatile __STREAM& stream = mDma.mBase->STREAM[mStream];
+    if (stream.CR.BITS.EN == 0) return true;
+    stream.CR.BITS.EN = 0;
+    for (unsigned int i = 0; i < STOP_POLL_COUNT; ++i)
     {
-        System::instance()->usleep(100000);
-        mDma.mBase->STREAM[mStream].CR.BITS.EN = 0;
+        if (stream.CR.BITS.EN != 0) continue;
+        // Stopping sets TransferComplete, it must not be taken for the end of the next transfer.
+        mDma.clearInterruptStatus(mStream, FifoError | DirectModeError | TransferError | HalfTransferComplete | TransferComplete);
+        return true;
     }
+    return false;
+}
+
+void Dma::Stream::setChannel(Dma::Stream::ChannelIndex channel)
+{
+    mChannel = static_cast<uint8_t>(channel);
+    mStreamConfig.BITS.CHSEL = mChannel;
 }
 
 void Dma::Stream::setBurstLength(Dma::Stream::End end, Dma::Stream::BurstLength burstLength)
@@ -181,6 +289,30 @@ void Dma::Stream::interruptCallback(InterruptController::Index /*index*/)
     // get and clear interrupt flags
     uint8_t status = mDma.getInterruptStatus(mStream);
     mDma.clearInterruptStatus(mStream, status);
+    if (mChainRemaining != 0)
+    {
+        if ((status & (TransferComplete | TransferError | DirectModeError)) != 0)
+        {
+            if ((status & (TransferError | DirectModeError)) == 0 && --mChainRemaining != 0)
+            {
+                ++mChain;
+                startSegment();
+                return;
+            }
+            mChainRemaining = 0;
+            for (const Segment* segment = mChainStart; segment <= mChain; ++segment) completeCache(segment->memory, segment->count, segment->memoryIncrement);
+        }
+    }
+    else if (mStreamConfig.BITS.DBM)
+    {
+        // The stream already switched to the other buffer when the interrupt comes.
+        if (status & TransferComplete)
+        {
+            mCompletedBuffer = mDma.mBase->STREAM[mStream].CR.BITS.CT ? End::Memory0 : End::Memory1;
+            completeCache(mCompletedBuffer == End::Memory0 ? mMemory0 : mMemory1, mCount, mStreamConfig.BITS.MINC);
+        }
+    }
+    else if (status & (TransferComplete | HalfTransferComplete)) completeCache(mMemory0, mCount, mStreamConfig.BITS.MINC);
     if (mCallback != nullptr)
     {
         Callback::Reason reason = Callback::Reason::HalfTransferComplete;
@@ -236,6 +368,31 @@ void Dma::Stream::setCircular(bool circular)
     mStreamConfig.BITS.CIRC = circular ? 1 : 0;
 }
 
+void Dma::Stream::setDoubleBuffer(bool doubleBuffer)
+{
+    mStreamConfig.BITS.DBM = doubleBuffer ? 1 : 0;
+}
+
+void Dma::Stream::setNextAddress(System::BaseAddress address)
+{
+    prepareCache(address, mCount, mStreamConfig.BITS.MINC);
+    if (mDma.mBase->STREAM[mStream].CR.BITS.CT)
+    {
+        mMemory0 = address;
+        mDma.mBase->STREAM[mStream].M0AR = address;
+    }
+    else
+    {
+        mMemory1 = address;
+        mDma.mBase->STREAM[mStream].M1AR = address;
+    }
+}
+
+void Dma::Stream::stop()
+{
+    mDma.mBase->STREAM[mStream].CR.BITS.EN = 0;
+}
+
 
 void Dma::Stream::configFifo(Dma::Stream::FifoThreshold threshold)
 {
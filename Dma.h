@@ -117,17 +117,38 @@ public:
             virtual void dmaCallback(Stream* stream, Reason reason) = 0;
         };
 
+        // One part of a chain, all other settings are those of the stream.
+        struct Segment
+        {
+            System::BaseAddress memory;
+            uint16_t count;
+            bool memoryIncrement;
+        };
+
         Stream(Dma& dma, StreamIndex stream, ChannelIndex channel, InterruptController::Line* interrupt);
         ~Stream();
 
-        void start();
-        void waitReady();
+        // Both stop a stream still running first, they return false without starting if it did not stop.
+        bool start();
+        bool waitReady();
+        // Transfers the segments one after the other, reprogramming the stream from the transfer complete interrupt,
+        // with one TransferComplete callback at the end. The segments must stay valid until then, not for circular streams.
+        bool startChain(const Segment* segments, unsigned int count);
+        bool chainActive() const { return mChainRemaining != 0; }
+
+        Dma& dma() const { return mDma; }
+        StreamIndex index() const { return static_cast<StreamIndex>(mStream); }
+        // Selects the request of this stream, only while it is stopped.
+        void setChannel(ChannelIndex channel);
 
         void setBurstLength(End end, BurstLength burstLength);
         void setPriority(Priority priority);
         void setDataSize(End end, DataSize dataSize);
         void setIncrement(End end, bool increment);
         void setDirection(Direction direction);
+        // With the data cache enabled, memory the DMA writes should start on and fill whole cache lines, see
+        // DmaBuffer. A line shared with other data is written back after the transfer to keep what the CPU stored
+        // there, which overwrites what the DMA wrote into that line if the CPU touched it during the transfer.
         void setAddress(End end, System::BaseAddress address);
         System::BaseAddress address(End end);
         System::BaseAddress currentAddress(End end);
@@ -137,9 +158,21 @@ public:
         uint16_t currentTransferCount() const { return mDma.mBase->STREAM[mStream].NDTR; }
         void setFlowControl(FlowControl flowControl);
         void setCircular(bool circular);
+        // Alternates between Memory0 and Memory1 without a gap, implies circular mode. Not for memory to memory.
+        // Each TransferComplete then reports one buffer done, see completedBuffer().
+        void setDoubleBuffer(bool doubleBuffer);
+        // The buffer of the last TransferComplete, valid until the next one.
+        End completedBuffer() const { return mCompletedBuffer; }
+        // Replaces the buffer that isn't currently in use. Call it from the TransferComplete callback, so the stream doesn't
+        // switch buffers in between, writing to the address of the active buffer stops the stream with a TransferError.
+        void setNextAddress(System::BaseAddress address);
+        void stop();
 
         void config(Direction direction, bool peripheralIncrement, bool memoryIncrement, DataSize peripheralDataSize, DataSize memoryDataSize, BurstLength peripheralBurst, BurstLength memoryBurst);
         void configFifo(FifoThreshold threshold);
+        // Lets start() pick memory data size, burst length and FIFO threshold from the alignment and length of the
+        // memory buffer, for fewer bus transactions. Replaces those settings, but only with memory increment.
+        void setAutoOptimize(bool autoOptimize) { mAutoOptimize = autoOptimize; }
 
         virtual void interruptCallback(InterruptController::Index index);
 
@@ -147,6 +180,9 @@ public:
         void enableHalfTransferComplete(bool enable = true);
 
     private:
+        // Register reads of EN after clearing it, far more than the bus cycles a stream needs to stop.
+        static const unsigned int STOP_POLL_COUNT = 1000;
+
         Dma& mDma;
         uint8_t mStream;
         uint8_t mChannel;
@@ -157,8 +193,18 @@ public:
         System::BaseAddress mMemory0;
         System::BaseAddress mMemory1;
         uint16_t mCount;
+        End mCompletedBuffer;
+        const Segment* mChain;
+        const Segment* mChainStart;
+        unsigned int mChainRemaining;
+        bool mAutoOptimize;
         Dma::__STREAM::__CR mStreamConfig;
         Dma::__STREAM::__FCR mFifoConfig;
+
+        void startSegment();
+        void optimize();
+        void prepareCache(System::BaseAddress memory, uint16_t count, bool increment);
+        void completeCache(System::BaseAddress memory, uint16_t count, bool increment);
     };
 
 };
@@ -0,0 +1,71 @@
+/*
+ * (c) 2012 Thomas Wihl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef DMABUFFER_H
+#define DMABUFFER_H
+
+#include "CacheControl.h"
+
+#include <cstdint>
+#include <type_traits>
+
+// Memory for DMA that starts on and fills whole cache lines, so cleaning and invalidating it never touches
+// other data. DmaBuffer<T, N> keeps its N elements inside the object, DmaBuffer<T> allocates them from the heap.
+template<typename T, unsigned int N = 0>
+class DmaBuffer
+{
+public:
+    DmaBuffer() { }
+
+    inline T* data() { return mData; }
+    inline T& operator[](unsigned int index) { return mData[index]; }
+    static constexpr unsigned int size() { return N; }
+    System::BaseAddress address() const { return reinterpret_cast<uintptr_t>(mData); }
+
+private:
+    static const unsigned int LINE_ELEMENTS = (CacheControl::LINE_SIZE + sizeof(T) - 1) / sizeof(T);
+    alignas(CacheControl::LINE_SIZE) T mData[(N + LINE_ELEMENTS - 1) / LINE_ELEMENTS * LINE_ELEMENTS];
+};
+
+template<typename T>
+class DmaBuffer<T, 0>
+{
+public:
+    DmaBuffer(unsigned int size) :
+        mSize(size),
+        mMemory(new uint8_t[(size * sizeof(T) + CacheControl::LINE_SIZE - 1) / CacheControl::LINE_SIZE * CacheControl::LINE_SIZE + CacheControl::LINE_SIZE - 1]),
+        mData(reinterpret_cast<T*>((reinterpret_cast<uintptr_t>(mMemory) + CacheControl::LINE_SIZE - 1) & ~static_cast<uintptr_t>(CacheControl::LINE_SIZE - 1)))
+    { }
+    ~DmaBuffer() { delete[] mMemory; }
+    static_assert(std::is_trivial<T>::value, "The elements aren't constructed, so they must not need it.");
+
+    inline T* data() { return mData; }
+    inline T& operator[](unsigned int index) { return mData[index]; }
+    unsigned int size() const { return mSize; }
+    System::BaseAddress address() const { return reinterpret_cast<uintptr_t>(mData); }
+
+private:
+    unsigned int mSize;
+    uint8_t* mMemory;
+    T* mData;
+
+    DmaBuffer(const DmaBuffer&) = delete;
+    DmaBuffer& operator=(const DmaBuffer&) = delete;
+};
+
+#endif // DMABUFFER_H
@@ -0,0 +1,152 @@
+/*
+ * (c) 2012 Thomas Wihl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "DmaManager.h"
+#include "atomic.h"
+
+// Controllers and streams numbered as in the reference manual, DMA1 is 1.
+const DmaManager::Mapping DmaManager::MAPPING[] =
+{
+    { Request::Spi1Rx, 2, 0, 3 }, { Request::Spi1Rx, 2, 2, 3 },
+    { Request::Spi1Tx, 2, 3, 3 }, { Request::Spi1Tx, 2, 5, 3 },
+    { Request::Spi2Rx, 1, 3, 0 },
+    { Request::Spi2Tx, 1, 4, 0 },
+    { Request::Spi3Rx, 1, 0, 0 }, { Request::Spi3Rx, 1, 2, 0 },
+    { Request::Spi3Tx, 1, 5, 0 }, { Request::Spi3Tx, 1, 7, 0 },
+    { Request::I2c1Rx, 1, 0, 1 }, { Request::I2c1Rx, 1, 5, 1 },
+    { Request::I2c1Tx, 1, 6, 1 }, { Request::I2c1Tx, 1, 7, 1 },
+    { Request::I2c2Rx, 1, 2, 7 }, { Request::I2c2Rx, 1, 3, 7 },
+    { Request::I2c2Tx, 1, 7, 7 },
+    { Request::I2c3Rx, 1, 2, 3 },
+    { Request::I2c3Tx, 1, 4, 3 },
+    { Request::Usart1Rx, 2, 2, 4 }, { Request::Usart1Rx, 2, 5, 4 },
+    { Request::Usart1Tx, 2, 7, 4 },
+    { Request::Usart2Rx, 1, 5, 4 },
+    { Request::Usart2Tx, 1, 6, 4 },
+    { Request::Usart3Rx, 1, 1, 4 },
+    { Request::Usart3Tx, 1, 3, 4 }, { Request::Usart3Tx, 1, 4, 7 },
+    { Request::Uart4Rx, 1, 2, 4 },
+    { Request::Uart4Tx, 1, 4, 4 },
+    { Request::Uart5Rx, 1, 0, 4 },
+    { Request::Uart5Tx, 1, 7, 4 },
+    { Request::Usart6Rx, 2, 1, 5 }, { Request::Usart6Rx, 2, 2, 5 },
+    { Request::Usart6Tx, 2, 6, 5 }, { Request::Usart6Tx, 2, 7, 5 },
+    { Request::Sdio, 2, 3, 4 }, { Request::Sdio, 2, 6, 4 },
+    { Request::Adc1, 2, 0, 0 }, { Request::Adc1, 2, 4, 0 },
+    { Request::Adc2, 2, 2, 1 }, { Request::Adc2, 2, 3, 1 },
+    { Request::Adc3, 2, 0, 2 }, { Request::Adc3, 2, 1, 2 },
+    { Request::Dac1, 1, 5, 7 },
+    { Request::Dac2, 1, 6, 7 },
+};
+
+DmaManager::DmaManager(Dma &dma1, Dma &dma2) :
+    mRefused(0),
+    mResetTime(0)
+{
+    mDma[0] = &dma1;
+    mDma[1] = &dma2;
+    for (unsigned int controller = 0; controller < CONTROLLER_COUNT; ++controller)
+    {
+        for (unsigned int index = 0; index < STREAM_COUNT; ++index)
+        {
+            Slot& slot = mSlot[controller][index];
+            slot.stream = nullptr;
+            slot.busy = false;
+            slot.user = nullptr;
+            slot.request = Request::Spi1Rx;
+            slot.acquiredAt = 0;
+            slot.statistics.acquired = 0;
+            slot.statistics.busyTime = 0;
+        }
+    }
+}
+
+void DmaManager::addStream(Dma::Stream *stream)
+{
+    for (unsigned int controller = 0; controller < CONTROLLER_COUNT; ++controller)
+    {
+        if (&stream->dma() == mDma[controller]) mSlot[controller][static_cast<unsigned int>(stream->index())].stream = stream;
+    }
+}
+
+Dma::Stream *DmaManager::acquire(DmaManager::Request request, Dma::Stream::Priority priority, const void *user, bool &reconfigure)
+{
+    Dma::Stream* stream = nullptr;
+    unsigned int primask = interrupt_disable();
+    for (const Mapping& map : MAPPING)
+    {
+        if (map.request != request) continue;
+        Slot& slot = mSlot[map.controller - 1][map.stream];
+        if (slot.stream != nullptr && !slot.busy)
+        {
+            stream = take(slot, map.channel, priority);
+            reconfigure = slot.user != user || slot.request != request;
+            slot.user = user;
+            slot.request = request;
+            break;
+        }
+    }
+    if (stream == nullptr) ++mRefused;
+    interrupt_restore(primask);
+    return stream;
+}
+
+void DmaManager::release(Dma::Stream *stream)
+{
+    unsigned int controller = 0;
+    while (controller < CONTROLLER_COUNT && &stream->dma() != mDma[controller]) ++controller;
+    if (controller == CONTROLLER_COUNT) return;
+    Slot& slot = mSlot[controller][static_cast<unsigned int>(stream->index())];
+
+    unsigned int primask = interrupt_disable();
+    if (slot.busy)
+    {
+        slot.statistics.busyTime += System::instance()->ns() - slot.acquiredAt;
+        slot.busy = false;
+    }
+    interrupt_restore(primask);
+}
+
+void DmaManager::resetStatistics()
+{
+    unsigned int primask = interrupt_disable();
+    uint64_t now = System::instance()->ns();
+    for (unsigned int controller = 0; controller < CONTROLLER_COUNT; ++controller)
+    {
+        for (unsigned int index = 0; index < STREAM_COUNT; ++index)
+        {
+            Slot& slot = mSlot[controller][index];
+            slot.statistics.acquired = 0;
+            slot.statistics.busyTime = 0;
+            if (slot.busy) slot.acquiredAt = now;
+        }
+    }
+    mRefused = 0;
+    mResetTime = now;
+    interrupt_restore(primask);
+}
+
+Dma::Stream *DmaManager::take(DmaManager::Slot &slot, uint8_t channel, Dma::Stream::Priority priority)
+{
+    slot.busy = true;
+    slot.acquiredAt = System::instance()->ns();
+    ++slot.statistics.acquired;
+    slot.stream->setChannel(static_cast<Dma::Stream::ChannelIndex>(channel));
+    slot.stream->setPriority(priority);
+    return slot.stream;
+}
@@ -0,0 +1,99 @@
+/*
+ * (c) 2012 Thomas Wihl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef DMAMANAGER_H
+#define DMAMANAGER_H
+
+#include "System.h"
+#include "Dma.h"
+
+#include <cstdint>
+
+// Hands out the streams of both DMA controllers per transfer, instead of tying them to one device for good.
+// Knows which stream and channel serve which peripheral request, in the mapping shared by the STM32F4
+// and the STM32F74x/75x. A device that gets no stream transfers by interrupt instead.
+class DmaManager
+{
+public:
+    enum class Request
+    {
+        Spi1Rx, Spi1Tx, Spi2Rx, Spi2Tx, Spi3Rx, Spi3Tx,
+        I2c1Rx, I2c1Tx, I2c2Rx, I2c2Tx, I2c3Rx, I2c3Tx,
+        Usart1Rx, Usart1Tx, Usart2Rx, Usart2Tx, Usart3Rx, Usart3Tx, Uart4Rx, Uart4Tx, Uart5Rx, Uart5Tx, Usart6Rx, Usart6Tx,
+        Sdio, Adc1, Adc2, Adc3, Dac1, Dac2
+    };
+
+    struct Statistics
+    {
+        uint32_t acquired;
+        uint64_t busyTime;
+    };
+
+    enum { CONTROLLER_COUNT = 2, STREAM_COUNT = 8 };
+
+    DmaManager(Dma& dma1, Dma& dma2);
+
+    // Only streams added here are handed out, leave out those used by DmaMemcpy or configured for good.
+    void addStream(Dma::Stream* stream);
+
+    // Returns a free stream set to the channel of the request, or nullptr if all that could serve it are busy.
+    // user identifies the caller, reconfigure is set if the stream served another user or request since, so its
+    // settings have to be written again.
+    Dma::Stream* acquire(Request request, Dma::Stream::Priority priority, const void* user, bool& reconfigure);
+    void release(Dma::Stream* stream);
+
+    // Indexed by controller (0 for DMA1) and stream, nullptr if the stream is not managed.
+    const Dma::Stream* stream(unsigned int controller, unsigned int index) const { return mSlot[controller][index].stream; }
+    const Statistics& statistics(unsigned int controller, unsigned int index) const { return mSlot[controller][index].statistics; }
+    bool busy(unsigned int controller, unsigned int index) const { return mSlot[controller][index].busy; }
+    // Requests that got no stream.
+    uint32_t refused() const { return mRefused; }
+    // In ns, as busyTime, both from ns() so they keep counting while the core sleeps.
+    uint64_t timeSinceReset() { return System::instance()->ns() - mResetTime; }
+    void resetStatistics();
+
+private:
+    struct Mapping
+    {
+        Request request;
+        uint8_t controller;
+        uint8_t stream;
+        uint8_t channel;
+    };
+    static const Mapping MAPPING[];
+
+    struct Slot
+    {
+        Dma::Stream* stream;
+        bool busy;
+        // Whoever configured the stream last, and for which request.
+        const void* user;
+        Request request;
+        uint64_t acquiredAt;
+        Statistics statistics;
+    };
+
+    Dma* mDma[CONTROLLER_COUNT];
+    Slot mSlot[CONTROLLER_COUNT][STREAM_COUNT];
+    uint32_t mRefused;
+    uint64_t mResetTime;
+
+    Dma::Stream* take(Slot& slot, uint8_t channel, Dma::Stream::Priority priority);
+};
+
+#endif // DMAMANAGER_H
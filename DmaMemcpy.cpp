@@ -0,0 +1,268 @@
+/*
+ * (c) 2012 Thomas Wihl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "DmaMemcpy.h"
+#include "HighResTimer.h"
+#include "atomic.h"
+
+#include <algorithm>
+#include <cstring>
+
+DmaMemcpy::DmaMemcpy() :
+    mChannelCount(0),
+    mQueueHead(nullptr),
+    mQueueTail(nullptr),
+    mCpuThreshold(DEFAULT_CPU_THRESHOLD),
+    mDmaCount(0),
+    mCpuCount(0),
+    mWaitTransfer(*this),
+    mWaitTimeout(*this, System::Event::Priority::High),
+    mWaitDone(0, 1)
+{
+    mWaitTransfer.mPost = false;
+}
+
+void DmaMemcpy::addStream(Dma::Stream *stream)
+{
+    if (mChannelCount >= MAX_STREAMS) return;
+    // Don't get in the way of peripherals using the same DMA.
+    stream->setPriority(Dma::Stream::Priority::Low);
+    stream->setCallback(this);
+    mChannel[mChannelCount].stream = stream;
+    mChannel[mChannelCount].transfer = nullptr;
+    ++mChannelCount;
+}
+
+bool DmaMemcpy::copy(Transfer *transfer, void *dst, const void *src, unsigned int size)
+{
+    return submit(transfer, dst, src, size, false, 0);
+}
+
+bool DmaMemcpy::fill(Transfer *transfer, void *dst, uint8_t value, unsigned int size)
+{
+    return submit(transfer, dst, nullptr, size, true, value);
+}
+
+void DmaMemcpy::copyWait(void *dst, const void *src, unsigned int size)
+{
+    // The completion interrupt can't come in an interrupt handler of the same or higher priority. Another thread
+    // may have claimed mWaitTransfer, then submit() refuses it.
+    System* system = System::instance();
+    if (system->inInterrupt() || !submit(&mWaitTransfer, dst, src, size, false, 0))
+    {
+        std::memcpy(dst, src, size);
+        ++mCpuCount;
+        return;
+    }
+    // Generous for the DMA even behind other transfers, a stream that hangs gets stopped and the CPU copies.
+    uint32_t timeout = (WAIT_TIMEOUT_NS + static_cast<uint64_t>(size) * WAIT_NS_PER_BYTE) / 1000;
+    Kernel* kernel = Kernel::instance();
+    if (Kernel::running() && !kernel->inMainThread())
+    {
+        // Other threads block until finish() or the timeout, which the event thread handles, post the semaphore.
+        // Without a high resolution timer, there is no timeout.
+        while (mWaitDone.tryWait())
+        {
+        }
+        HighResTimer* timer = system->highResTimer();
+        bool timed = timer != nullptr && timer->sleepFor(&mWaitTimeout, timeout);
+        if (!mWaitTransfer.done()) mWaitDone.wait();
+        if (timed) timer->cancel(&mWaitTimeout);
+    }
+    else
+    {
+        uint64_t end = system->ns() + static_cast<uint64_t>(timeout) * 1000;
+        while (!mWaitTransfer.done() && system->ns() <= end)
+        {
+        }
+    }
+    if (!mWaitTransfer.done() && cancel(&mWaitTransfer))
+    {
+        std::memcpy(dst, src, size);
+        ++mCpuCount;
+        mWaitTransfer.mDone = true;
+    }
+    // It completed while we cancelled.
+    while (!mWaitTransfer.done())
+    {
+    }
+}
+
+void DmaMemcpy::eventCallback(System::Event *event)
+{
+    if (event == &mWaitTimeout) mWaitDone.post();
+}
+
+void DmaMemcpy::dmaCallback(Dma::Stream *stream, Dma::Stream::Callback::Reason reason)
+{
+    if (reason == Reason::HalfTransferComplete) return;
+    unsigned int primask = interrupt_disable();
+    for (unsigned int i = 0; i < mChannelCount; ++i)
+    {
+        Channel& channel = mChannel[i];
+        if (channel.stream != stream || channel.transfer == nullptr) continue;
+        Transfer* transfer = channel.transfer;
+        if (reason == Reason::TransferComplete)
+        {
+            transfer->mDst += transfer->mChunk;
+            if (!transfer->mFill) transfer->mSrc += transfer->mChunk;
+            transfer->mSize -= transfer->mChunk;
+            if (startChunk(channel)) break;
+            finish(transfer, System::Event::Result::Success);
+        }
+        else finish(transfer, System::Event::Result::DataFail);
+        channel.transfer = nullptr;
+        dispatch();
+        break;
+    }
+    interrupt_restore(primask);
+}
+
+bool DmaMemcpy::submit(Transfer *transfer, void *dst, const void *src, unsigned int size, bool fill, uint8_t value)
+{
+    // Claimed with interrupts disabled, a thread switch between test and set would let two callers share it.
+    unsigned int primask = interrupt_disable();
+    bool idle = transfer->mDone;
+    transfer->mDone = false;
+    interrupt_restore(primask);
+    if (!idle) return false;
+    uint8_t* d = static_cast<uint8_t*>(dst);
+    const uint8_t* s = static_cast<const uint8_t*>(src);
+    if (size < mCpuThreshold || size < static_cast<unsigned int>(MIN_DMA_SIZE) || mChannelCount == 0)
+    {
+        if (fill) std::memset(d, value, size);
+        else std::memcpy(d, s, size);
+        ++mCpuCount;
+        finish(transfer, System::Event::Result::Success);
+        return true;
+    }
+
+    // The widest unit both addresses can be aligned to, the CPU copies up to the first aligned address.
+    uint32_t misalignment = fill ? 0 : address(d) ^ address(s);
+    unsigned int unit = (misalignment & 3) == 0 ? 4 : ((misalignment & 1) == 0 ? 2 : 1);
+    unsigned int head = (0 - address(d)) & (unit - 1);
+    if (fill) std::memset(d, value, head);
+    else std::memcpy(d, s, head);
+
+    transfer->mNext = nullptr;
+    transfer->mDst = d + head;
+    transfer->mSrc = fill ? nullptr : s + head;
+    transfer->mSize = size - head;
+    transfer->mPattern = value * 0x01010101U;
+    transfer->mUnit = unit;
+    transfer->mFill = fill;
+    ++mDmaCount;
+
+    primask = interrupt_disable();
+    if (mQueueTail != nullptr) mQueueTail->mNext = transfer;
+    else mQueueHead = transfer;
+    mQueueTail = transfer;
+    dispatch();
+    interrupt_restore(primask);
+    return true;
+}
+
+// Takes the transfer out of the queue or stops its stream, false if it completed meanwhile. It is left not done.
+bool DmaMemcpy::cancel(Transfer *transfer)
+{
+    bool cancelled = false;
+    unsigned int primask = interrupt_disable();
+    Transfer* previous = nullptr;
+    for (Transfer* queued = mQueueHead; queued != nullptr; previous = queued, queued = queued->mNext)
+    {
+        if (queued != transfer) continue;
+        if (previous != nullptr) previous->mNext = queued->mNext;
+        else mQueueHead = queued->mNext;
+        if (mQueueTail == queued) mQueueTail = previous;
+        cancelled = true;
+        break;
+    }
+    for (unsigned int i = 0; !cancelled && i < mChannelCount; ++i)
+    {
+        Channel& channel = mChannel[i];
+        if (channel.transfer != transfer) continue;
+        channel.stream->waitReady();
+        channel.transfer = nullptr;
+        cancelled = true;
+        dispatch();
+    }
+    interrupt_restore(primask);
+    return cancelled;
+}
+
+// Hands queued transfers to idle streams, called with interrupts disabled.
+void DmaMemcpy::dispatch()
+{
+    for (unsigned int i = 0; i < mChannelCount; ++i)
+    {
+        Channel& channel = mChannel[i];
+        while (channel.transfer == nullptr && mQueueHead != nullptr)
+        {
+            channel.transfer = mQueueHead;
+            mQueueHead = mQueueHead->mNext;
+            if (mQueueHead == nullptr) mQueueTail = nullptr;
+            if (!startChunk(channel))
+            {
+                finish(channel.transfer, System::Event::Result::Success);
+                channel.transfer = nullptr;
+            }
+        }
+    }
+}
+
+// Starts the DMA on the next part of the transfer, or copies the rest with the CPU and returns false.
+bool DmaMemcpy::startChunk(Channel &channel)
+{
+    Transfer* transfer = channel.transfer;
+    unsigned int unit = transfer->mUnit;
+    if (transfer->mSize < static_cast<unsigned int>(MIN_DMA_SIZE))
+    {
+        if (transfer->mFill) std::memset(transfer->mDst, transfer->mPattern & 0xff, transfer->mSize);
+        else std::memcpy(transfer->mDst, transfer->mSrc, transfer->mSize);
+        transfer->mSize = 0;
+        return false;
+    }
+    System::BaseAddress src = transfer->mFill ? address(&transfer->mPattern) : address(transfer->mSrc);
+    unsigned int items = std::min<unsigned int>(transfer->mSize / unit, MAX_ITEMS);
+    Dma::Stream::BurstLength burst = Dma::Stream::BurstLength::Single;
+    // A burst fills the FIFO of 16 bytes and must not cross a 1KB boundary, which aligned bursts never do.
+    if (((address(transfer->mDst) | (transfer->mFill ? 0 : src)) & 15) == 0)
+    {
+        items &= ~(16 / unit - 1);
+        burst = unit == 4 ? Dma::Stream::BurstLength::Beats4 : (unit == 2 ? Dma::Stream::BurstLength::Beats8 : Dma::Stream::BurstLength::Beats16);
+    }
+    Dma::Stream::DataSize dataSize = unit == 4 ? Dma::Stream::DataSize::Word : (unit == 2 ? Dma::Stream::DataSize::HalfWord : Dma::Stream::DataSize::Byte);
+
+    Dma::Stream* stream = channel.stream;
+    stream->config(Dma::Stream::Direction::MemoryToMemory, !transfer->mFill, true, dataSize, dataSize, burst, burst);
+    stream->configFifo(Dma::Stream::FifoThreshold::Full);
+    stream->setAddress(Dma::Stream::End::MemoryToMemorySource, src);
+    stream->setAddress(Dma::Stream::End::MemoryToMemoryDestination, address(transfer->mDst));
+    stream->setTransferCount(items);
+    transfer->mChunk = items * unit;
+    stream->start();
+    return true;
+}
+
+void DmaMemcpy::finish(Transfer *transfer, System::Event::Result result)
+{
+    transfer->setResult(result);
+    transfer->mDone = true;
+    if (transfer->mPost) System::instance()->postEvent(transfer);
+    else mWaitDone.post();
+}
@@ -0,0 +1,116 @@
+/*
+ * (c) 2012 Thomas Wihl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef DMAMEMCPY_H
+#define DMAMEMCPY_H
+
+#include "System.h"
+#include "Dma.h"
+#include "Kernel.h"
+
+#include <cstdint>
+
+// Copies and fills memory with memory to memory streams of DMA2, completing through an event.
+// Transfers are queued and handed to the next free stream. As far as the alignment of source and destination
+// allows, the DMA moves words in bursts, the unaligned start and end and transfers below cpuThreshold() are done
+// by the CPU right away. Source and destination must not overlap.
+class DmaMemcpy : public Dma::Stream::Callback, public System::Event::Callback
+{
+public:
+    class Transfer : public System::Event
+    {
+    public:
+        Transfer(System::Event::Callback& callback, Priority priority = Priority::Normal) : System::Event(callback, priority), mNext(nullptr), mDone(true), mPost(true)
+        { }
+
+        bool done() const { return mDone; }
+    private:
+        friend class DmaMemcpy;
+        Transfer* mNext;
+        uint8_t* mDst;
+        const uint8_t* mSrc;
+        unsigned int mSize;
+        unsigned int mChunk;
+        uint32_t mPattern;
+        uint8_t mUnit;
+        bool mFill;
+        volatile bool mDone;
+        bool mPost;
+    };
+
+    enum { MAX_STREAMS = 4 };
+    // Where a DMA transfer of the F7 at 216MHz starts to pay off, measure it with the "bench memcpy" command.
+    static const unsigned int DEFAULT_CPU_THRESHOLD = 256;
+
+    DmaMemcpy();
+
+    // The stream must belong to DMA2, which is the only one that can access memory on both ports.
+    void addStream(Dma::Stream* stream);
+
+    // Return false if the transfer is still busy with a previous request.
+    bool copy(Transfer* transfer, void* dst, const void* src, unsigned int size);
+    bool fill(Transfer* transfer, void* dst, uint8_t value, unsigned int size);
+    // Copies with the DMA and waits for it, in interrupt handlers with the CPU. Threads other than the event thread
+    // block meanwhile, the event thread busy waits.
+    void copyWait(void* dst, const void* src, unsigned int size);
+
+    void setCpuThreshold(unsigned int size) { mCpuThreshold = size; }
+    unsigned int cpuThreshold() const { return mCpuThreshold; }
+    uint32_t dmaCount() const { return mDmaCount; }
+    uint32_t cpuCount() const { return mCpuCount; }
+
+    virtual const char* name() const { return "memcpy"; }
+
+protected:
+    virtual void dmaCallback(Dma::Stream* stream, Reason reason);
+    virtual void eventCallback(System::Event* event);
+
+private:
+    // Below MIN_DMA_SIZE the rest of a transfer is done by the CPU, it can't be moved in one burst anyway.
+    enum { MIN_DMA_SIZE = 16, MAX_ITEMS = 65535 };
+    // How long copyWait() waits for the DMA, 1ms for transfers queued ahead plus 10MB/s.
+    static const unsigned int WAIT_TIMEOUT_NS = 1000000;
+    static const unsigned int WAIT_NS_PER_BYTE = 100;
+
+    struct Channel
+    {
+        Dma::Stream* stream;
+        Transfer* transfer;
+    };
+
+    Channel mChannel[MAX_STREAMS];
+    unsigned int mChannelCount;
+    Transfer* mQueueHead;
+    Transfer* mQueueTail;
+    unsigned int mCpuThreshold;
+    uint32_t mDmaCount;
+    uint32_t mCpuCount;
+    Transfer mWaitTransfer;
+    // Wake up a thread waiting in copyWait().
+    System::Event mWaitTimeout;
+    Kernel::Semaphore mWaitDone;
+
+    static System::BaseAddress address(const void* pointer) { return reinterpret_cast<uintptr_t>(pointer); }
+    bool submit(Transfer* transfer, void* dst, const void* src, unsigned int size, bool fill, uint8_t value);
+    bool cancel(Transfer* transfer);
+    void dispatch();
+    bool startChunk(Channel& channel);
+    void finish(Transfer* transfer, System::Event::Result result);
+};
+
+#endif // DMAMEMCPY_H
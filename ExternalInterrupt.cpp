@@ -110,6 +110,11 @@ void ExternalInterrupt::Line::disable()
     mInterruptController.mBase->IMR = mInterruptController.mBase->IMR & ~(1 << mIndex);
 }
 
+void ExternalInterrupt::Line::clearPending()
+{
+    mInterruptController.mBase->PR = 1 << mIndex;
+}
+
 InterruptController::Index ExternalInterrupt::Line::index()
 {
     return mIndex;
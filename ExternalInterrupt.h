@@ -38,6 +38,7 @@ public:
         void setCallback(InterruptController::Callback *handler);
         void enable(Trigger trigger);
         void disable();
+        void clearPending();
         InterruptController::Index index();
     private:
         ExternalInterrupt& mInterruptController;
@@ -0,0 +1,79 @@
+/*
+ * (c) 2012 Thomas Wihl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef FRAMING_H
+#define FRAMING_H
+
+#include "CircularBuffer.h"
+
+#include <cstdint>
+
+// Packet framing for byte streams: SLIP (RFC 1055) or COBS, each frame carries its payload followed by a
+// CRC-16/CCITT-FALSE (little endian) and ends with the delimiter. Encoding and decoding work on the two regions
+// a CircularBuffer hands out, so frames can be built in a transmit FIFO and decoded in place in a receive FIFO.
+class Framing
+{
+public:
+    enum class Mode { Slip, Cobs };
+    typedef CircularBuffer<char>::Region Region;
+
+    enum { CRC_SIZE = 2 };
+
+    static char delimiter(Mode mode) { return mode == Mode::Slip ? static_cast<char>(SLIP_END) : 0; }
+    // Worst case size of an encoded frame of len bytes payload, CRC and delimiter included.
+    static unsigned int maxEncodedSize(Mode mode, unsigned int len);
+    // Returns the encoded size, 0 if the frame doesn't fit into the regions.
+    static unsigned int encode(Mode mode, const char* data, unsigned int len, Region first, Region second);
+    // Decodes a frame in place, len includes the delimiter. The payload starts at first.data and continues at
+    // second.data if it doesn't fit into first. Returns the payload size or -1 if the frame is malformed or its
+    // CRC doesn't match.
+    static int decode(Mode mode, Region first, Region second, unsigned int len);
+    // Decodes into data instead, leaving the regions untouched. size must hold the payload and the CRC.
+    static int decode(Mode mode, Region first, Region second, unsigned int len, char* data, unsigned int size);
+
+    static uint16_t crc16(const char* data, unsigned int len, uint16_t crc = 0xffff);
+
+private:
+    enum
+    {
+        SLIP_END = 0xc0,
+        SLIP_ESC = 0xdb,
+        SLIP_ESC_END = 0xdc,
+        SLIP_ESC_ESC = 0xdd,
+        COBS_BLOCK = 0xff
+    };
+
+    // Two regions addressed as one.
+    class Split
+    {
+    public:
+        Split(Region first, Region second) : mFirst(first), mSecond(second) { }
+        unsigned int size() const { return mFirst.len + mSecond.len; }
+        char& operator[](unsigned int index) { return index < mFirst.len ? mFirst.data[index] : mSecond.data[index - mFirst.len]; }
+        uint16_t crc16(unsigned int len);
+    private:
+        Region mFirst;
+        Region mSecond;
+    };
+
+    static int decode(Mode mode, Split frame, unsigned int len, Split output);
+
+    static const uint16_t sCrcTable[256];
+};
+
+#endif // FRAMING_H
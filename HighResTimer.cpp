@@ -0,0 +1,193 @@
+/*
+ * (c) 2012 Thomas Wihl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "HighResTimer.h"
+#include "atomic.h"
+
+HighResTimer::HighResTimer(Timer &timer) :
+    mTimer(timer),
+    mChannelsUsed(0),
+    mQueueSize(0)
+{
+    for (unsigned int i = 0; i < CHANNEL_COUNT; ++i) mChannel[i].event = nullptr;
+    mTimer.setCallback(this);
+}
+
+HighResTimer::~HighResTimer()
+{
+    for (unsigned int i = 0; i < CHANNEL_COUNT; ++i) mTimer.enableCaptureCompareIrq(static_cast<Timer::CaptureCompareIndex>(i), false);
+    mTimer.setCallback(nullptr);
+}
+
+void HighResTimer::start(const ClockControl &clockControl)
+{
+    mTimer.disable();
+    mTimer.setCountMode(Timer::CountMode::Up);
+    mTimer.setPrescaler(clockControl.clock(mTimer.clock()) / 1000000 - 1);
+    mTimer.setReload(0xffffffff);
+    for (unsigned int i = 0; i < CHANNEL_COUNT; ++i)
+    {
+        // Compare registers without preload, so a new deadline is active as soon as it is written.
+        mTimer.configCompare(static_cast<Timer::CaptureCompareIndex>(i), Timer::CompareMode::Inactive, Timer::CompareOutput::Disabled, Timer::CompareOutput::Disabled, false);
+    }
+    mTimer.generateUpdate();
+    mTimer.enable();
+}
+
+bool HighResTimer::sleepUntil(System::Event *event, uint32_t us)
+{
+    unsigned int primask = interrupt_disable();
+    remove(event);
+    event->setResult(System::Event::Result::Success);
+    Entry entry = { event, us };
+    bool success = true;
+    if (mChannelsUsed < CHANNEL_COUNT)
+    {
+        unsigned int channel = 0;
+        while (mChannel[channel].event != nullptr) ++channel;
+        arm(channel, entry);
+    }
+    else
+    {
+        unsigned int latest = 0;
+        for (unsigned int i = 1; i < CHANNEL_COUNT; ++i)
+        {
+            if (before(mChannel[latest].deadline, mChannel[i].deadline)) latest = i;
+        }
+        // The earliest deadlines must not get lost, the latest of all gives way to an earlier one. It's posted with
+        // Result::Busy, its owner learns that way that it wasn't kept. The queue holds the latest, the channels
+        // always get the earliest.
+        if (mQueueSize >= QUEUE_SIZE && before(us, mQueue[QUEUE_SIZE - 1].deadline))
+        {
+            --mQueueSize;
+            mQueue[mQueueSize].event->setResult(System::Event::Result::Busy);
+            System::instance()->postEvent(mQueue[mQueueSize].event);
+        }
+        if (mQueueSize >= QUEUE_SIZE) success = false;
+        else if (before(us, mChannel[latest].deadline))
+        {
+            // Move the latest programmed deadline back into the queue to make room for the earlier one.
+            enqueue(mChannel[latest]);
+            release(latest);
+            if (!arm(latest, entry)) refill(latest);
+        }
+        else enqueue(entry);
+    }
+    interrupt_restore(primask);
+    return success;
+}
+
+bool HighResTimer::cancel(System::Event *event)
+{
+    unsigned int primask = interrupt_disable();
+    bool found = remove(event);
+    interrupt_restore(primask);
+    return found;
+}
+
+void HighResTimer::timerCallback(Timer::EventType type)
+{
+    if (type == Timer::EventType::Update) return;
+    unsigned int channel = static_cast<unsigned int>(type) - static_cast<unsigned int>(Timer::EventType::CaptureCompare1);
+    unsigned int primask = interrupt_disable();
+    // The flag could also be left over from a deadline that arm() already posted itself.
+    if (mChannel[channel].event != nullptr && reached(mChannel[channel].deadline))
+    {
+        System::instance()->reportLatency((now() - mChannel[channel].deadline) * 1000);
+        System::instance()->postEvent(mChannel[channel].event);
+        release(channel);
+        refill(channel);
+    }
+    interrupt_restore(primask);
+}
+
+// Returns false if the deadline was already too close and got posted right away.
+bool HighResTimer::arm(unsigned int channel, const Entry &entry)
+{
+    if (static_cast<int32_t>(entry.deadline - now()) < MIN_LEAD_US)
+    {
+        System::instance()->postEvent(entry.event);
+        return false;
+    }
+    Timer::CaptureCompareIndex index = static_cast<Timer::CaptureCompareIndex>(channel);
+    mChannel[channel] = entry;
+    ++mChannelsUsed;
+    mTimer.setCompare(index, entry.deadline);
+    mTimer.enableCaptureCompareIrq(index, true);
+    // If an interrupt of higher priority delayed us past the deadline, the compare won't match until the counter wraps.
+    if (reached(entry.deadline))
+    {
+        release(channel);
+        System::instance()->postEvent(entry.event);
+        return false;
+    }
+    return true;
+}
+
+void HighResTimer::release(unsigned int channel)
+{
+    mTimer.enableCaptureCompareIrq(static_cast<Timer::CaptureCompareIndex>(channel), false);
+    mChannel[channel].event = nullptr;
+    --mChannelsUsed;
+}
+
+void HighResTimer::refill(unsigned int channel)
+{
+    while (mQueueSize > 0)
+    {
+        Entry entry = mQueue[0];
+        --mQueueSize;
+        for (unsigned int i = 0; i < mQueueSize; ++i) mQueue[i] = mQueue[i + 1];
+        if (arm(channel, entry)) break;
+    }
+}
+
+void HighResTimer::enqueue(const Entry &entry)
+{
+    unsigned int i = mQueueSize;
+    while (i > 0 && before(entry.deadline, mQueue[i - 1].deadline))
+    {
+        mQueue[i] = mQueue[i - 1];
+        --i;
+    }
+    mQueue[i] = entry;
+    ++mQueueSize;
+}
+
+bool HighResTimer::remove(System::Event *event)
+{
+    for (unsigned int i = 0; i < CHANNEL_COUNT; ++i)
+    {
+        if (mChannel[i].event == event)
+        {
+            release(i);
+            refill(i);
+            return true;
+        }
+    }
+    for (unsigned int i = 0; i < mQueueSize; ++i)
+    {
+        if (mQueue[i].event == event)
+        {
+            --mQueueSize;
+            for (; i < mQueueSize; ++i) mQueue[i] = mQueue[i + 1];
+            return true;
+        }
+    }
+    return false;
+}
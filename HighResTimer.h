@@ -0,0 +1,80 @@
+/*
+ * (c) 2012 Thomas Wihl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef HIGHRESTIMER_H
+#define HIGHRESTIMER_H
+
+#include "System.h"
+#include "Timer.h"
+
+#include <stdint.h>
+
+// Microsecond deadlines on a free-running 32 bit timer (TIM2 or TIM5), posting an event when they expire.
+// The four compare channels each hold one deadline, further ones wait in a queue sorted by deadline.
+// Times are compared modulo 2^32, so a deadline must lie less than 2^31us (about 35 minutes) ahead.
+class HighResTimer : public Timer::Callback
+{
+public:
+    enum { QUEUE_SIZE = 16 };
+
+    HighResTimer(Timer& timer);
+    ~HighResTimer();
+
+    // Programs the prescaler for a 1MHz count and restarts now() at 0.
+    // Call it again after changing the timer clock, but only with no deadlines pending.
+    void start(const ClockControl& clockControl);
+    uint32_t now() { return mTimer.counter(); }
+
+    // Posts event when now() reaches us, right away if that already happened. An event can only be pending once.
+    // With too many deadlines pending, the latest of them is posted right away with Result::Busy to make room,
+    // false is returned only if the new deadline is the latest itself.
+    bool sleepUntil(System::Event* event, uint32_t us);
+    bool sleepFor(System::Event* event, uint32_t us) { return sleepUntil(event, now() + us); }
+    bool cancel(System::Event* event);
+    unsigned int pending() const { return mQueueSize + mChannelsUsed; }
+
+protected:
+    virtual void timerCallback(Timer::EventType type);
+
+private:
+    enum { CHANNEL_COUNT = 4 };
+    // Deadlines this close are posted right away, programming the compare register would take longer.
+    static const int32_t MIN_LEAD_US = 2;
+
+    struct Entry
+    {
+        System::Event* event;
+        uint32_t deadline;
+    };
+
+    static bool before(uint32_t a, uint32_t b) { return static_cast<int32_t>(a - b) < 0; }
+    bool reached(uint32_t deadline) { return static_cast<int32_t>(now() - deadline) >= 0; }
+    bool arm(unsigned int channel, const Entry& entry);
+    void release(unsigned int channel);
+    void refill(unsigned int channel);
+    void enqueue(const Entry& entry);
+    bool remove(System::Event* event);
+
+    Timer& mTimer;
+    Entry mChannel[CHANNEL_COUNT];
+    unsigned int mChannelsUsed;
+    Entry mQueue[QUEUE_SIZE];
+    unsigned int mQueueSize;
+};
+
+#endif // HIGHRESTIMER_H
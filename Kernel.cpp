@@ -0,0 +1,431 @@
+/*
+ * (c) 2012 Thomas Wihl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "Kernel.h"
+#include "atomic.h"
+
+#include <cassert>
+
+extern "C"
+{
+
+unsigned int* KernelSwitch(unsigned int* stackPointer)
+{
+    return Kernel::instance()->switchContext(stackPointer);
+}
+
+// Saves the remaining registers of the current thread on its stack and restores the ones of the next thread.
+// The FPU registers are only saved if the thread used the FPU (bit 4 of EXC_RETURN cleared), saving s16-s31
+// also triggers the lazy stacking of s0-s15 done by the hardware on exception entry.
+void __attribute__((naked)) PendSV()
+{
+    __asm volatile("mrs r0, psp");
+    __asm volatile("tst lr, #0x10");
+    __asm volatile("it eq");
+    __asm volatile("vstmdbeq r0!, {s16-s31}");
+    __asm volatile("stmdb r0!, {r4-r11, lr}");
+    __asm volatile("bl KernelSwitch");
+    __asm volatile("ldmia r0!, {r4-r11, lr}");
+    __asm volatile("tst lr, #0x10");
+    __asm volatile("it eq");
+    __asm volatile("vldmiaeq r0!, {s16-s31}");
+    __asm volatile("msr psp, r0");
+    __asm volatile("bx lr");
+}
+
+}   // extern "C"
+
+Kernel* Kernel::mKernel;
+const unsigned int Kernel::LOWEST_PRIORITY;
+
+Kernel::Thread::Thread(const char *name, unsigned int priority, unsigned int stackSize) :
+    Thread(name, priority, nullptr, nullptr)
+{
+    mStackStart = new unsigned int[stackSize / sizeof(unsigned int)];
+    mStackEnd = mStackStart + stackSize / sizeof(unsigned int);
+    mOwnsStack = true;
+    System::fillStack(mStackStart, mStackEnd);
+    initFrame();
+}
+
+Kernel::Thread::Thread(const char *name, unsigned int priority, unsigned int *stackStart, unsigned int *stackEnd) :
+    mStackPointer(nullptr),
+    mStackStart(stackStart),
+    mStackEnd(stackEnd),
+    mName(name),
+    mBasePriority(priority),
+    mPriority(priority),
+    mState(State::Ready),
+    mCpuTime(0),
+    mOwnsStack(false),
+    mNext(nullptr),
+    mNextWaiting(nullptr),
+    mHeldMutex(nullptr),
+    mBlockedOn(nullptr)
+{
+}
+
+Kernel::Thread::~Thread()
+{
+    if (mOwnsStack) delete[] mStackStart;
+}
+
+unsigned int Kernel::Thread::stackMaxUsed() const
+{
+    return stackSize() - System::stackUnused(mStackStart, mStackEnd);
+}
+
+// Builds the stack as PendSV leaves it: r4-r11 and EXC_RETURN below the frame the hardware pops on exception return.
+void Kernel::Thread::initFrame()
+{
+    unsigned int* sp = reinterpret_cast<unsigned int*>(reinterpret_cast<uintptr_t>(mStackEnd) & ~static_cast<uintptr_t>(7));
+    *--sp = 0x01000000;                                                             // xPSR (thumb)
+    *--sp = static_cast<unsigned int>(reinterpret_cast<uintptr_t>(&Kernel::threadEntry)) & ~1U;    // PC
+    *--sp = 0;                                                                      // LR
+    *--sp = 0;                                                                      // R12
+    *--sp = 0;                                                                      // R3
+    *--sp = 0;                                                                      // R2
+    *--sp = 0;                                                                      // R1
+    *--sp = static_cast<unsigned int>(reinterpret_cast<uintptr_t>(this));           // R0
+    *--sp = 0xfffffffd;                                                             // EXC_RETURN: thread mode, PSP, no FPU state
+    for (int i = 0; i < 8; ++i) *--sp = 0;                                          // R11-R4
+    mStackPointer = sp;
+}
+
+Kernel::MainThread::MainThread(unsigned int priority) :
+    Thread("main", priority, reinterpret_cast<unsigned int*>(&__stack_start), reinterpret_cast<unsigned int*>(&__stack_end))
+{
+}
+
+Kernel::IdleThread::IdleThread() :
+    Thread("idle", LOWEST_PRIORITY, 512)
+{
+}
+
+void Kernel::IdleThread::run()
+{
+    while (true)
+    {
+        __asm("wfi");
+    }
+}
+
+Kernel::Semaphore::Semaphore(unsigned int count, unsigned int maxCount) :
+    mCount(count),
+    mMaxCount(maxCount),
+    mWaiting(nullptr)
+{
+}
+
+void Kernel::prepareWaitForEvent()
+{
+    atomic_store_release(&mEventWaiting, 1);
+    // The flag must be visible before the queue gets checked, a post in between then wakes us.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+// If a poster took the flag in the meantime, the semaphore stays posted and the next wait returns right away.
+void Kernel::cancelWaitForEvent()
+{
+    while (mEventWaiting != 0 && !atomic_compare_exchange(&mEventWaiting, 1, 0))
+    {
+    }
+}
+
+void Kernel::Semaphore::post()
+{
+    unsigned int primask = interrupt_disable();
+    Thread* thread = Kernel::removeWaiting(mWaiting);
+    if (thread != nullptr) Kernel::instance()->wake(thread);
+    else if (mCount < mMaxCount) ++mCount;
+    interrupt_restore(primask);
+}
+
+void Kernel::Semaphore::wait()
+{
+    if (!Kernel::running())
+    {
+        // Every exception return sets the event register, so a post() from an interrupt ends the wfe.
+        while (!tryWait()) __asm("wfe");
+        return;
+    }
+    unsigned int primask = interrupt_disable();
+    if (mCount > 0) --mCount;
+    else Kernel::instance()->block(mWaiting);
+    // The context switch happens here, we continue once post() made us ready again.
+    interrupt_restore(primask);
+}
+
+bool Kernel::Semaphore::tryWait()
+{
+    unsigned int primask = interrupt_disable();
+    bool success = mCount > 0;
+    if (success) --mCount;
+    interrupt_restore(primask);
+    return success;
+}
+
+Kernel::Mutex::Mutex() :
+    mOwner(nullptr),
+    mWaiting(nullptr),
+    mNextHeld(nullptr)
+{
+}
+
+void Kernel::Mutex::lock()
+{
+    // Before the kernel runs there is only one thread, so there is nothing to protect against.
+    if (!Kernel::running()) return;
+    Kernel* kernel = Kernel::instance();
+    Thread* current = kernel->mCurrent;
+    unsigned int primask = interrupt_disable();
+    if (mOwner == nullptr)
+    {
+        mOwner = current;
+        mNextHeld = current->mHeldMutex;
+        current->mHeldMutex = this;
+    }
+    else
+    {
+        // Lend our priority to the owner and to whoever the owner waits for.
+        current->mBlockedOn = this;
+        for (Mutex* mutex = this; mutex != nullptr && mutex->mOwner != nullptr && current->mPriority < mutex->mOwner->mPriority; mutex = mutex->mOwner->mBlockedOn)
+        {
+            mutex->mOwner->mPriority = current->mPriority;
+        }
+        kernel->block(mWaiting);
+    }
+    // If we had to wait, unlock() handed the mutex over to us before making us ready.
+    interrupt_restore(primask);
+}
+
+bool Kernel::Mutex::tryLock()
+{
+    if (!Kernel::running()) return true;
+    Thread* current = Kernel::instance()->mCurrent;
+    unsigned int primask = interrupt_disable();
+    bool success = mOwner == nullptr;
+    if (success)
+    {
+        mOwner = current;
+        mNextHeld = current->mHeldMutex;
+        current->mHeldMutex = this;
+    }
+    interrupt_restore(primask);
+    return success;
+}
+
+void Kernel::Mutex::unlock()
+{
+    if (!Kernel::running()) return;
+    Kernel* kernel = Kernel::instance();
+    unsigned int primask = interrupt_disable();
+    Thread* owner = mOwner;
+    assert(owner == kernel->mCurrent);
+    Mutex** held = &owner->mHeldMutex;
+    while (*held != this) held = &(*held)->mNextHeld;
+    *held = mNextHeld;
+    mNextHeld = nullptr;
+
+    Thread* next = Kernel::removeWaiting(mWaiting);
+    mOwner = next;
+    // Drop any priority we inherited through this mutex before the next owner gets the chance to run.
+    kernel->updatePriority(owner);
+    if (next != nullptr)
+    {
+        next->mBlockedOn = nullptr;
+        mNextHeld = next->mHeldMutex;
+        next->mHeldMutex = this;
+        kernel->updatePriority(next);
+        kernel->wake(next);
+    }
+    interrupt_restore(primask);
+}
+
+Kernel::Kernel(unsigned int mainPriority, unsigned int handlerStackSize) :
+    mMainThread(mainPriority),
+    mIdleThread(),
+    mHandlerStackStart(new unsigned int[handlerStackSize / sizeof(unsigned int)]),
+    mHandlerStackEnd(mHandlerStackStart + handlerStackSize / sizeof(unsigned int)),
+    mThreads(&mMainThread),
+    mCurrent(nullptr),
+    mStartTime(0),
+    mLastSwitch(0),
+    mEventSemaphore(0, 1),
+    mEventWaiting(0),
+    mRunning(false)
+{
+    // Make sure we are the first and only instance
+    assert(mKernel == nullptr);
+    mKernel = this;
+    System::fillStack(mHandlerStackStart, mHandlerStackEnd);
+    mMainThread.mNext = &mIdleThread;
+}
+
+Kernel::~Kernel()
+{
+    delete[] mHandlerStackStart;
+}
+
+void Kernel::addThread(Thread *thread)
+{
+    unsigned int primask = interrupt_disable();
+    Thread** last = &mThreads;
+    while (*last != nullptr) last = &(*last)->mNext;
+    *last = thread;
+    if (mRunning && thread->mPriority < mCurrent->mPriority) reschedule();
+    interrupt_restore(primask);
+}
+
+// From here on the caller runs as the main thread on the process stack, while exceptions use a stack of their own.
+void Kernel::start()
+{
+    assert(!mRunning);
+    // PendSV gets the lowest priority, so a context switch never preempts an interrupt handler.
+    System::instance()->setTrapPriority(System::TrapIndex::PendSV, 0xff);
+    mCurrent = &mMainThread;
+    mStartTime = mLastSwitch = System::instance()->ns();
+    unsigned int* handlerStack = reinterpret_cast<unsigned int*>(reinterpret_cast<uintptr_t>(mHandlerStackEnd) & ~static_cast<uintptr_t>(7));
+    __asm volatile("mrs r0, msp\n"
+                   "msr psp, r0\n"
+                   "mrs r0, control\n"
+                   "orr r0, r0, #2\n"
+                   "msr control, r0\n"
+                   "isb\n"
+                   "msr msp, %0"
+                   : : "r" (handlerStack) : "r0", "memory");
+    mRunning = true;
+    System::instance()->setKernel(this);
+    reschedule();
+}
+
+void Kernel::yield()
+{
+    reschedule();
+}
+
+uint64_t Kernel::timeSinceStart()
+{
+    return System::instance()->ns() - mStartTime;
+}
+
+// Includes the time the current thread has been running since it was switched in.
+uint64_t Kernel::cpuTime(Thread *thread)
+{
+    unsigned int primask = interrupt_disable();
+    uint64_t time = thread->mCpuTime;
+    if (thread == mCurrent) time += System::instance()->ns() - mLastSwitch;
+    interrupt_restore(primask);
+    return time;
+}
+
+unsigned int Kernel::handlerStackMaxUsed() const
+{
+    return (mHandlerStackEnd - mHandlerStackStart) * sizeof(unsigned int) - System::stackUnused(mHandlerStackStart, mHandlerStackEnd);
+}
+
+// Called from PendSV with the stack pointer of the current thread, returns the one of the thread to run next.
+unsigned int* Kernel::switchContext(unsigned int *stackPointer)
+{
+    uint64_t now = System::instance()->ns();
+    mCurrent->mStackPointer = stackPointer;
+    mCurrent->mCpuTime += now - mLastSwitch;
+    mLastSwitch = now;
+
+    // Start searching after the current thread, so threads of the same priority take turns on yield().
+    unsigned int primask = interrupt_disable();
+    Thread* best = nullptr;
+    Thread* thread = mCurrent;
+    do
+    {
+        thread = thread->mNext != nullptr ? thread->mNext : mThreads;
+        if (thread->mState == Thread::State::Ready && (best == nullptr || thread->mPriority < best->mPriority)) best = thread;
+    }   while (thread != mCurrent);
+    // The idle thread is always ready, so we always find one.
+    mCurrent = best;
+    interrupt_restore(primask);
+    return best->mStackPointer;
+}
+
+void Kernel::threadEntry(Thread *thread)
+{
+    thread->run();
+    unsigned int primask = interrupt_disable();
+    thread->mState = Thread::State::Finished;
+    mKernel->reschedule();
+    interrupt_restore(primask);
+    // We never get scheduled again
+    while (true) ;
+}
+
+// Waiting threads are kept in FIFO order, the first one with the highest priority is woken up.
+void Kernel::addWaiting(Thread *&list, Thread *thread)
+{
+    Thread** last = &list;
+    while (*last != nullptr) last = &(*last)->mNextWaiting;
+    *last = thread;
+    thread->mNextWaiting = nullptr;
+}
+
+Kernel::Thread *Kernel::removeWaiting(Thread *&list)
+{
+    Thread** best = nullptr;
+    for (Thread** thread = &list; *thread != nullptr; thread = &(*thread)->mNextWaiting)
+    {
+        if (best == nullptr || (*thread)->mPriority < (*best)->mPriority) best = thread;
+    }
+    if (best == nullptr) return nullptr;
+    Thread* thread = *best;
+    *best = thread->mNextWaiting;
+    thread->mNextWaiting = nullptr;
+    return thread;
+}
+
+// Must be called with interrupts disabled, the switch happens as soon as they are enabled again.
+void Kernel::block(Thread *&list)
+{
+    addWaiting(list, mCurrent);
+    mCurrent->mState = Thread::State::Blocked;
+    reschedule();
+}
+
+void Kernel::wake(Thread *thread)
+{
+    thread->mState = Thread::State::Ready;
+    if (thread->mPriority < mCurrent->mPriority) reschedule();
+}
+
+// The priority of a thread is its base priority or the one of the highest thread waiting for a mutex it holds.
+void Kernel::updatePriority(Thread *thread)
+{
+    unsigned int priority = thread->mBasePriority;
+    for (Mutex* mutex = thread->mHeldMutex; mutex != nullptr; mutex = mutex->mNextHeld)
+    {
+        for (Thread* waiting = mutex->mWaiting; waiting != nullptr; waiting = waiting->mNextWaiting)
+        {
+            if (waiting->mPriority < priority) priority = waiting->mPriority;
+        }
+    }
+    if (priority > thread->mPriority && thread == mCurrent) reschedule();
+    thread->mPriority = priority;
+}
+
+void Kernel::reschedule()
+{
+    if (mRunning) System::instance()->pendSV();
+}
@@ -0,0 +1,197 @@
+/*
+ * (c) 2012 Thomas Wihl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef KERNEL_H
+#define KERNEL_H
+
+#include "System.h"
+#include "atomic.h"
+
+#include <cstdint>
+
+// Optional preemptive kernel with fixed priority threads, a lower number means a higher priority.
+// Threads of the same priority run until they block or call yield(), there is no time slicing.
+// Kernel::start() turns the code calling it (usually main() with the System event loop) into a thread
+// of its own, waiting for events then blocks that thread so lower priority threads can run.
+class Kernel
+{
+public:
+    class Semaphore;
+    class Mutex;
+
+    // Threads can't be removed once added, they have to live as long as the kernel.
+    class Thread
+    {
+    public:
+        enum class State { Ready, Blocked, Finished };
+
+        Thread(const char* name, unsigned int priority, unsigned int stackSize);
+        virtual ~Thread();
+
+        const char* name() const { return mName; }
+        unsigned int priority() const { return mPriority; }
+        unsigned int basePriority() const { return mBasePriority; }
+        State state() const { return mState; }
+        uint64_t cpuTime() const { return mCpuTime; }
+        unsigned int stackSize() const { return (mStackEnd - mStackStart) * sizeof(unsigned int); }
+        unsigned int stackMaxUsed() const;
+
+    protected:
+        virtual void run() = 0;
+
+    private:
+        friend class Kernel;
+        friend class Semaphore;
+        friend class Mutex;
+
+        Thread(const char* name, unsigned int priority, unsigned int* stackStart, unsigned int* stackEnd);
+        void initFrame();
+
+        unsigned int* mStackPointer;
+        unsigned int* mStackStart;
+        unsigned int* mStackEnd;
+        const char* mName;
+        unsigned int mBasePriority;
+        unsigned int mPriority;
+        State mState;
+        uint64_t mCpuTime;
+        bool mOwnsStack;
+        Thread* mNext;
+        Thread* mNextWaiting;
+        Mutex* mHeldMutex;
+        Mutex* mBlockedOn;
+    };
+
+    // Counting semaphore, post() can be called from interrupt handlers and driver callbacks.
+    class Semaphore
+    {
+    public:
+        Semaphore(unsigned int count = 0, unsigned int maxCount = ~0U);
+
+        void post();
+        void wait();
+        bool tryWait();
+        unsigned int count() const { return mCount; }
+
+    private:
+        volatile unsigned int mCount;
+        unsigned int mMaxCount;
+        Thread* mWaiting;
+    };
+
+    // Non recursive mutex with priority inheritance, only to be used from threads.
+    class Mutex
+    {
+    public:
+        Mutex();
+
+        void lock();
+        bool tryLock();
+        void unlock();
+        Thread* owner() const { return mOwner; }
+
+    private:
+        friend class Kernel;
+
+        Thread* mOwner;
+        Thread* mWaiting;
+        Mutex* mNextHeld;
+    };
+
+    Kernel(unsigned int mainPriority, unsigned int handlerStackSize = 2048);
+    ~Kernel();
+
+    static inline Kernel* instance() { return mKernel; }
+    static inline bool running() { return mKernel != nullptr && mKernel->mRunning; }
+
+    void addThread(Thread* thread);
+    void start();
+    void yield();
+
+    Thread* current() const { return mCurrent; }
+    // The thread that called start(), it runs the System event loop.
+    bool inMainThread() const { return mCurrent == &mMainThread; }
+    Thread* threads() const { return mThreads; }
+    Thread* next(Thread* thread) const { return thread->mNext; }
+    uint64_t timeSinceStart();
+    uint64_t cpuTime(Thread* thread);
+    unsigned int handlerStackMaxUsed() const;
+
+    // Called by System, waitForEvent() blocks the calling thread until eventPosted() is called. The thread announces
+    // itself with prepareWaitForEvent() before its last look at the event queue and backs out with cancelWaitForEvent()
+    // if it found an event, so eventPosted() only touches the semaphore (and masks interrupts) if somebody waits.
+    void prepareWaitForEvent();
+    void cancelWaitForEvent();
+    void waitForEvent() { mEventSemaphore.wait(); }
+    void eventPosted()
+    {
+        // The flag is taken by one poster only, the compare exchange may also fail when interrupted, so try again.
+        while (mEventWaiting != 0)
+        {
+            if (atomic_compare_exchange(&mEventWaiting, 1, 0))
+            {
+                mEventSemaphore.post();
+                break;
+            }
+        }
+    }
+
+    unsigned int* switchContext(unsigned int* stackPointer);
+
+private:
+    class MainThread : public Thread
+    {
+    public:
+        MainThread(unsigned int priority);
+    protected:
+        virtual void run() { }
+    };
+
+    class IdleThread : public Thread
+    {
+    public:
+        IdleThread();
+    protected:
+        virtual void run();
+    };
+
+    static const unsigned int LOWEST_PRIORITY = ~0U;
+    static Kernel* mKernel;
+
+    MainThread mMainThread;
+    IdleThread mIdleThread;
+    unsigned int* mHandlerStackStart;
+    unsigned int* mHandlerStackEnd;
+    Thread* mThreads;
+    Thread* mCurrent;
+    uint64_t mStartTime;
+    uint64_t mLastSwitch;
+    Semaphore mEventSemaphore;
+    volatile unsigned int mEventWaiting;
+    bool mRunning;
+
+    static void threadEntry(Thread* thread);
+    static void addWaiting(Thread*& list, Thread* thread);
+    static Thread* removeWaiting(Thread*& list);
+    void block(Thread*& list);
+    void wake(Thread* thread);
+    void updatePriority(Thread* thread);
+    void reschedule();
+};
+
+#endif // KERNEL_H
@@ -0,0 +1,109 @@
+/*
+ * (c) 2012 Thomas Wihl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef MPSCQUEUE_H
+#define MPSCQUEUE_H
+
+#include "atomic.h"
+
+#include <cstdint>
+
+// Lock free queue for many producers (interrupts of any priority) and one consumer (the main loop).
+// A producer claims a slot by advancing the write index with LDREX/STREX and then publishes it by
+// updating the sequence number of the slot. If an interrupt preempts a producer between claiming and
+// publishing, the consumer just sees the queue as empty up to that slot until the producer resumes.
+// Nothing ever disables interrupts, so pushing has a constant cost independent of the queue load.
+template<typename T, unsigned int N>
+class MpscQueue
+{
+public:
+    MpscQueue();
+
+    bool push(T elem);
+    bool pop(T& elem);
+
+    inline unsigned int used() { return atomic_load_acquire(&mWrite) - mRead; }
+    inline unsigned int size() const { return N; }
+    inline uint32_t overflowCount() const { return mOverflow; }
+    inline unsigned int highWater() const { return mHighWater; }
+
+private:
+    static_assert(N != 0 && (N & (N - 1)) == 0, "MpscQueue capacity has to be a power of two.");
+
+    struct Slot
+    {
+        volatile unsigned int sequence;
+        T elem;
+    };
+
+    Slot mSlot[N];
+    volatile unsigned int mWrite;
+    volatile unsigned int mRead;
+    volatile int32_t mOverflow;
+    volatile unsigned int mHighWater;
+};
+
+template<typename T, unsigned int N>
+MpscQueue<T, N>::MpscQueue() :
+    mWrite(0),
+    mRead(0),
+    mOverflow(0),
+    mHighWater(0)
+{
+    for (unsigned int i = 0; i < N; ++i) mSlot[i].sequence = i;
+}
+
+template<typename T, unsigned int N>
+bool MpscQueue<T, N>::push(T elem)
+{
+    unsigned int write;
+    Slot* slot;
+    while (true)
+    {
+        write = atomic_load_acquire(&mWrite);
+        slot = &mSlot[write & (N - 1)];
+        int diff = static_cast<int>(atomic_load_acquire(&slot->sequence) - write);
+        if (diff < 0)
+        {
+            // The consumer didn't free this slot yet, we are full.
+            atomic_add(&mOverflow, 1);
+            return false;
+        }
+        if (diff == 0 && atomic_compare_exchange(&mWrite, write, write + 1)) break;
+    }
+    unsigned int depth = write + 1 - mRead;
+    unsigned int highWater = mHighWater;
+    while (depth > highWater && !atomic_compare_exchange(&mHighWater, highWater, depth)) highWater = mHighWater;
+    slot->elem = elem;
+    atomic_store_release(&slot->sequence, write + 1);
+    return true;
+}
+
+template<typename T, unsigned int N>
+bool MpscQueue<T, N>::pop(T& elem)
+{
+    unsigned int read = mRead;
+    Slot* slot = &mSlot[read & (N - 1)];
+    if (atomic_load_acquire(&slot->sequence) != read + 1) return false;
+    elem = slot->elem;
+    atomic_store_release(&slot->sequence, read + N);
+    mRead = read + 1;
+    return true;
+}
+
+#endif // MPSCQUEUE_H
@@ -15,3 +15,15 @@ bool Power::backupDomainWp()
 {
     return mBase->CR.DBP;
 }
+
+void Power::configStop(bool lowPowerRegulator, bool flashPowerDown)
+{
+    mBase->CR.PDDS = 0;
+    mBase->CR.LPDS = lowPowerRegulator ? 1 : 0;
+    mBase->CR.FPDS = flashPowerDown ? 1 : 0;
+}
+
+void Power::clearWakeupFlag()
+{
+    mBase->CR.CWUF = 1;
+}
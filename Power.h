@@ -10,6 +10,10 @@ public:
 
     void setBackupDomainWp(bool enable);
     bool backupDomainWp();
+
+    // Configures what happens on a deep sleep (SLEEPDEEP set), we never use standby as it resets the core.
+    void configStop(bool lowPowerRegulator, bool flashPowerDown);
+    void clearWakeupFlag();
 private:
     struct PWR
     {
@@ -0,0 +1,133 @@
+/*
+ * (c) 2012 Thomas Wihl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "Rtc.h"
+
+Rtc::Rtc(System::BaseAddress base, Power &power, uint32_t clock) :
+    mBase(reinterpret_cast<volatile RTC*>(base)),
+    mPower(power),
+    mClock(clock),
+    mSyncPrescaler(clock / ASYNC_PRESCALER),
+    mExti(nullptr)
+{
+    static_assert(sizeof(RTC) == 0x2c, "Struct has wrong size, compiler problem.");
+    unlock();
+    // The backup domain keeps a calendar running across resets, entering init mode again would shift it. Its
+    // prescaler is kept then, whoever initialised it may have chosen another one. Without a date set, INITS stays
+    // clear, our own prescaler tells that we already initialised it.
+    if (mBase->ISR.INITS || (mBase->PRER.PREDIV_S == mSyncPrescaler - 1 && mBase->PRER.PREDIV_A == ASYNC_PRESCALER - 1))
+    {
+        mSyncPrescaler = mBase->PRER.PREDIV_S + 1;
+    }
+    else
+    {
+        // Run the sub second counter at ~1kHz instead of the default 256Hz, so we get ms resolution.
+        mBase->ISR.INIT = 1;
+        while (!mBase->ISR.INITF)
+        {
+        }
+        mBase->PRER.PREDIV_S = mSyncPrescaler - 1;
+        mBase->PRER.PREDIV_A = ASYNC_PRESCALER - 1;
+        mBase->ISR.INIT = 0;
+    }
+    // Read the counters directly, the shadow registers are not updated in stop mode.
+    mBase->CR.BYPSHAD = 1;
+    lock();
+}
+
+void Rtc::setWakeupInterrupt(InterruptController::Line *irq, ExternalInterrupt::Line *exti)
+{
+    mExti = exti;
+    if (mExti != nullptr) mExti->enable(ExternalInterrupt::Trigger::Rising);
+    if (irq != nullptr)
+    {
+        irq->setCallback(this);
+        irq->enable();
+    }
+}
+
+unsigned int Rtc::maxWakeupMs() const
+{
+    return 65536ULL * WAKEUP_PRESCALER * 1000 / mClock;
+}
+
+void Rtc::startWakeup(unsigned int ms)
+{
+    // We rather wake up a little early than late
+    uint32_t count = static_cast<uint64_t>(ms) * mClock / WAKEUP_PRESCALER / 1000;
+    if (count == 0) count = 1;
+    if (count > 65536) count = 65536;
+    unlock();
+    mBase->CR.WUTE = 0;
+    while (!mBase->ISR.WUTWF)
+    {
+    }
+    mBase->WUTR = count - 1;
+    mBase->CR.WUCKSEL = 0;      // RTCCLK / 16
+    mBase->ISR.WUTF = 0;
+    mBase->CR.WUTIE = 1;
+    mBase->CR.WUTE = 1;
+    lock();
+}
+
+void Rtc::stopWakeup()
+{
+    unlock();
+    mBase->CR.WUTE = 0;
+    mBase->CR.WUTIE = 0;
+    mBase->ISR.WUTF = 0;
+    lock();
+    if (mExti != nullptr) mExti->clearPending();
+}
+
+uint32_t Rtc::milliseconds()
+{
+    uint32_t ssr, tr;
+    do
+    {
+        ssr = mBase->SSR;
+        tr = mBase->TR;
+    }   while (ssr != mBase->SSR);
+    // BCD coded time of day
+    uint32_t seconds = (tr & 0xf) + ((tr >> 4) & 0x7) * 10;
+    seconds += ((tr >> 8) & 0xf) * 60 + ((tr >> 12) & 0x7) * 600;
+    seconds += ((tr >> 16) & 0xf) * 3600 + ((tr >> 20) & 0x3) * 36000;
+    // The sub second register counts down
+    return seconds * 1000 + (mSyncPrescaler - 1 - ssr) * 1000 / mSyncPrescaler;
+}
+
+void Rtc::interruptCallback(InterruptController::Index /*index*/)
+{
+    unlock();
+    mBase->ISR.WUTF = 0;
+    lock();
+    if (mExti != nullptr) mExti->clearPending();
+}
+
+void Rtc::unlock()
+{
+    mPower.setBackupDomainWp(false);
+    mBase->WPR = 0xca;
+    mBase->WPR = 0x53;
+}
+
+void Rtc::lock()
+{
+    mBase->WPR = 0xff;
+    mPower.setBackupDomainWp(true);
+}
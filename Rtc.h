@@ -0,0 +1,127 @@
+/*
+ * (c) 2012 Thomas Wihl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef RTC_H
+#define RTC_H
+
+#include "System.h"
+#include "Power.h"
+#include "InterruptController.h"
+#include "ExternalInterrupt.h"
+
+// Minimal real time clock driver, used as time base and wakeup source while the core is in stop mode.
+// The RTC clock itself has to be selected and enabled with ClockControl::enableRtc() first.
+class Rtc : public InterruptController::Callback
+{
+public:
+    Rtc(System::BaseAddress base, Power& power, uint32_t clock = 32768);
+
+    // The wakeup interrupt is connected to EXTI line 22, which has to be enabled to leave stop mode.
+    void setWakeupInterrupt(InterruptController::Line* irq, ExternalInterrupt::Line* exti);
+    unsigned int maxWakeupMs() const;
+    void startWakeup(unsigned int ms);
+    void stopWakeup();
+
+    // Time of day in ms, wraps at midnight.
+    uint32_t milliseconds();
+    static uint32_t msBetween(uint32_t start, uint32_t end) { return end >= start ? end - start : end + MS_PER_DAY - start; }
+
+protected:
+    virtual void interruptCallback(InterruptController::Index index);
+
+private:
+    static const uint32_t MS_PER_DAY = 24 * 60 * 60 * 1000;
+    static const uint32_t ASYNC_PRESCALER = 32;
+    static const uint32_t WAKEUP_PRESCALER = 16;
+
+    struct RTC
+    {
+        uint32_t TR;
+        uint32_t DR;
+        struct __CR
+        {
+            uint32_t WUCKSEL : 3;
+            uint32_t TSEDGE : 1;
+            uint32_t REFCKON : 1;
+            uint32_t BYPSHAD : 1;
+            uint32_t FMT : 1;
+            uint32_t DCE : 1;
+            uint32_t ALRAE : 1;
+            uint32_t ALRBE : 1;
+            uint32_t WUTE : 1;
+            uint32_t TSE : 1;
+            uint32_t ALRAIE : 1;
+            uint32_t ALRBIE : 1;
+            uint32_t WUTIE : 1;
+            uint32_t TSIE : 1;
+            uint32_t ADD1H : 1;
+            uint32_t SUB1H : 1;
+            uint32_t BKP : 1;
+            uint32_t COSEL : 1;
+            uint32_t POL : 1;
+            uint32_t OSEL : 2;
+            uint32_t COE : 1;
+            uint32_t __RESERVED0 : 8;
+        }   CR;
+        struct __ISR
+        {
+            uint32_t ALRAWF : 1;
+            uint32_t ALRBWF : 1;
+            uint32_t WUTWF : 1;
+            uint32_t SHPF : 1;
+            uint32_t INITS : 1;
+            uint32_t RSF : 1;
+            uint32_t INITF : 1;
+            uint32_t INIT : 1;
+            uint32_t ALRAF : 1;
+            uint32_t ALRBF : 1;
+            uint32_t WUTF : 1;
+            uint32_t TSF : 1;
+            uint32_t TSOVF : 1;
+            uint32_t TAMP1F : 1;
+            uint32_t TAMP2F : 1;
+            uint32_t __RESERVED0 : 1;
+            uint32_t RECALPF : 1;
+            uint32_t __RESERVED1 : 15;
+        }   ISR;
+        struct __PRER
+        {
+            uint32_t PREDIV_S : 15;
+            uint32_t __RESERVED0 : 1;
+            uint32_t PREDIV_A : 7;
+            uint32_t __RESERVED1 : 9;
+        }   PRER;
+        uint32_t WUTR;
+        uint32_t CALIBR;
+        uint32_t ALRMAR;
+        uint32_t ALRMBR;
+        uint32_t WPR;
+        uint32_t SSR;
+    };
+
+    volatile RTC* mBase;
+    Power& mPower;
+    uint32_t mClock;
+    uint32_t mSyncPrescaler;
+    ExternalInterrupt::Line* mExti;
+
+    void unlock();
+    void lock();
+};
+
+#endif // RTC_H
@@ -20,6 +20,7 @@
 
 #include <cassert>
 #include <cstdio>
+#include <cstdlib>
 
 #ifdef STM32F7
 #define __SR __SR_F7
@@ -32,7 +33,8 @@ Serial::Serial(System::BaseAddress base, ClockControl *clockControl, ClockContro
     mBase(reinterpret_cast<volatile USART*>(base)),
     mClockControl(clockControl),
     mClock(clock),
-    mSpeed(0)
+    mSpeed(0),
+    mSpeedError(0)
 {
     static_assert(sizeof(USART_F4) == 0x1c, "Struct has wrong size, compiler problem.");
     static_assert(sizeof(USART_F7) == 0x2c, "Struct has wrong size, compiler problem.");
@@ -44,15 +46,42 @@ Serial::~Serial()
     disable(Device::All);
 }
 
+// Either way the bit time is divider peripheral clocks: 16x oversampling needs a divider of at least 16,
+// 8x oversampling of at least 8 and has one bit less for the mantissa.
+Serial::Baud Serial::calculate(uint32_t clock, uint32_t speed)
+{
+    Baud best = Baud();
+    for (unsigned int over8 = 0; over8 < 2; ++over8)
+    {
+        uint32_t divider = (clock + speed / 2) / speed;
+        uint32_t min = over8 ? 8 : 16;
+        uint32_t max = over8 ? 0x7fff : 0xffff;
+        if (divider < min) divider = min;
+        else if (divider > max) divider = max;
+        Baud baud;
+        baud.speed = (clock + divider / 2) / divider;
+        baud.errorPpm = static_cast<int32_t>((static_cast<int64_t>(baud.speed) - speed) * 1000000 / speed);
+        baud.divider = static_cast<uint16_t>(divider);
+        baud.over8 = over8 != 0;
+        if (over8 == 0 || std::abs(baud.errorPpm) < std::abs(best.errorPpm)) best = baud;
+    }
+    return best;
+}
+
 uint32_t Serial::setSpeed(uint32_t speed)
 {
-    uint32_t clock = mClockControl->clock(mClock);
-    uint32_t accuracy = 8 * (2 - mBase->CR1.OVER8);
-    uint32_t divider = (clock + speed / 2) / speed;
-    mBase->BRR.DIV_MANTISSA = divider / accuracy;
-    mBase->BRR.DIV_FRACTION = divider % accuracy;
+    Baud baud = calculate(mClockControl->clock(mClock), speed);
+    // OVER8 and BRR can only be changed while the USART is disabled.
+    bool enabled = mBase->CR1.UE;
+    mBase->CR1.UE = 0;
+    mBase->CR1.OVER8 = baud.over8;
+    // With 8x oversampling the fraction has 3 bits only, its highest bit must stay cleared.
+    mBase->BRR.DIV_MANTISSA = baud.over8 ? baud.divider >> 3 : baud.divider >> 4;
+    mBase->BRR.DIV_FRACTION = baud.over8 ? baud.divider & 0x7 : baud.divider & 0xf;
+    mBase->CR1.UE = enabled;
     mSpeed = speed;
-    return clock / divider;
+    mSpeedError = baud.errorPpm;
+    return baud.speed;
 }
 
 void Serial::setWordLength(Serial::WordLength dataBits)
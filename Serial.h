@@ -46,7 +46,21 @@ public:
     Serial(System::BaseAddress base, ClockControl* clockControl, ClockControl::ClockSpeed clock);
     virtual ~Serial();
 
+    // Divider and oversampling reaching a speed from a peripheral clock.
+    struct Baud
+    {
+        uint32_t speed;
+        // Deviation of speed from the requested one, in parts per million.
+        int32_t errorPpm;
+        uint16_t divider;
+        bool over8;
+    };
+    // Picks the oversampling with the smaller error, 16x if both are equal as it tolerates more noise.
+    // 8x oversampling reaches up to clock / 8.
+    static Baud calculate(uint32_t clock, uint32_t speed);
+    // Returns the achieved speed, speedError() tells how far it is off.
     uint32_t setSpeed(uint32_t speed);
+    int32_t speedError() const { return mSpeedError; }
     void setWordLength(WordLength dataBits);
     void setParity(Parity parity);
     void setStopBits(StopBits stopBits);
@@ -328,6 +342,7 @@ private:
     ClockControl* mClockControl;
     ClockControl::ClockSpeed mClock;
     uint32_t mSpeed;
+    int32_t mSpeedError;
 
 #ifdef STM32F7
     inline volatile uint32_t* rdr() const { return &mBase->RDR; }
@@ -5,7 +5,7 @@ Spi::Spi(System::BaseAddress base, ClockControl *clockControl, ClockControl::Clo
     mBase(reinterpret_cast<volatile SPI*>(base)),
     mClockControl(clockControl),
     mClock(clock),
-    mTransferBuffer(64)
+    mPosition(0)
 {
     static_assert(sizeof(SPI) == 0x24, "Struct has wrong size, compiler problem.");
     //mBase->CR1.DFF = (sizeof(T) == 1) ? 0 : 1;
@@ -54,7 +54,7 @@ bool Spi::transfer(Transfer *transfer)
 {
     bool success = mTransferBuffer.push(transfer);
     //printf("PUSH\n", ((transfer->mReadData != nullptr) ? "R" : "-"), transfer->mReadData, ((transfer->mWriteData != nullptr) ? "W" : "-"), transfer->mWriteData, transfer->mLength);
-    if (mBase->CR2.RXDMAEN == 0 && mBase->CR2.TXDMAEN == 0) nextTransfer();
+    if (mBase->CR2.RXDMAEN == 0 && mBase->CR2.TXDMAEN == 0 && mBase->CR2.RXNEIE == 0) nextTransfer();
     return success;
 }
 
@@ -62,19 +62,41 @@ void Spi::nextTransfer()
 {
     Transfer* t;
 
-    if (mTransferBuffer.back(t))
+    // Looping, not recursing, a queue of transfers that all fail must not use up the stack.
+    while (mTransferBuffer.back(t))
     {
         if (t->mLength == 0)
         {
             mTransferBuffer.pop(t);
-            nextTransfer();
-            return;
+            continue;
+        }
+        bool dma = acquireDma(t->mWriteData != nullptr, t->mReadData != nullptr);
+        if (!dma && mInterrupt == nullptr)
+        {
+            // Nothing would drive an interrupt transfer, it fails before its chip gets selected.
+            mTransferBuffer.pop(t);
+            if (t->mEvent != nullptr)
+            {
+                t->mEvent->setResult(System::Event::Result::Busy);
+                System::instance()->postEvent(t->mEvent);
+            }
+            continue;
         }
         //printf("SPI POP %s(%08x)%s(%08x) %i bytes\n", ((t->mReadData != nullptr) ? "R" : "-"), t->mReadData, ((t->mWriteData != nullptr) ? "W" : "-"), t->mWriteData, t->mLength);
         if (t->mChip != nullptr) t->mChip->prepare();
         if (t->mChipSelect != nullptr) t->mChipSelect->select();
         setSpeed(t->mMaxSpeed);
         config(t->mClockPolarity, t->mClockPhase, t->mEndianess);
+        if (!dma)
+        {
+            // No DMA for this one, receiving a byte sends the next one.
+            mBase->CR2.TXDMAEN = 0;
+            mBase->CR2.RXDMAEN = 0;
+            mPosition = 0;
+            mBase->CR2.RXNEIE = 1;
+            mBase->DR = (t->mWriteData != nullptr) ? t->mWriteData[0] : 0xff;
+            return;
+        }
         if (mDmaRead != nullptr && t->mReadData != nullptr)
         {
             mBase->CR2.RXDMAEN = 1;
@@ -91,13 +113,11 @@ void Spi::nextTransfer()
             mDmaWrite->setTransferCount(t->mLength);
             mDmaWrite->start();
         }
+        return;
     }
-    else
-    {
-        //printf("SPI IDLE\n");
-        mBase->CR2.TXDMAEN = 0;
-        mBase->CR2.RXDMAEN = 0;
-    }
+    //printf("SPI IDLE\n");
+    mBase->CR2.TXDMAEN = 0;
+    mBase->CR2.RXDMAEN = 0;
 }
 
 void Spi::writeSync()
@@ -129,12 +149,14 @@ void Spi::configDma(Dma::Stream *write, Dma::Stream *read)
         mDmaWrite->config(Dma::Stream::Direction::MemoryToPeripheral, false, true, dataSize, dataSize, Dma::Stream::BurstLength::Single, Dma::Stream::BurstLength::Single);
         mDmaWrite->setAddress(Dma::Stream::End::Peripheral, reinterpret_cast<System::BaseAddress>(&mBase->DR));
         mDmaWrite->configFifo(Dma::Stream::FifoThreshold::Quater);
+        mDmaWrite->setAutoOptimize(true);
     }
     if (Device::mDmaRead != nullptr)
     {
         mDmaRead->config(Dma::Stream::Direction::PeripheralToMemory, false, true, dataSize, dataSize, Dma::Stream::BurstLength::Single, Dma::Stream::BurstLength::Single);
         mDmaRead->setAddress(Dma::Stream::End::Peripheral, reinterpret_cast<System::BaseAddress>(&mBase->DR));
-        mDmaWrite->configFifo(Dma::Stream::FifoThreshold::Quater);
+        mDmaRead->configFifo(Dma::Stream::FifoThreshold::Quater);
+        mDmaRead->setAutoOptimize(true);
     }
 }
 
@@ -147,19 +169,26 @@ void Spi::clockCallback(ClockControl::Callback::Reason reason, uint32_t /*newClo
 
 void Spi::interruptCallback(InterruptController::Index /*index*/)
 {
+    Transfer* t;
+    if (!mBase->SR.RXNE || !mTransferBuffer.back(t)) return;
+    uint8_t data = static_cast<uint8_t>(mBase->DR);
+    if (t->mReadData != nullptr) t->mReadData[mPosition] = data;
+    if (++mPosition < t->mLength)
+    {
+        mBase->DR = (t->mWriteData != nullptr) ? t->mWriteData[mPosition] : 0xff;
+    }
+    else
+    {
+        mBase->CR2.RXNEIE = 0;
+        finishTransfer();
+    }
 }
 
 
 void Spi::dmaReadComplete()
 {
     //printf("RX DONE\n");
-    Transfer* t;
-    if (mTransferBuffer.pop(t))
-    {
-        if (t->mChipSelect != nullptr) t->mChipSelect->deselect();
-        if (t->mEvent != nullptr) System::instance()->postEvent(t->mEvent);
-        nextTransfer();
-    }
+    finishTransfer();
 }
 
 
@@ -169,13 +198,23 @@ void Spi::dmaWriteComplete()
     Transfer* t;
     if (mTransferBuffer.back(t))
     {
-        if (t->mReadData == nullptr)
+        if (t->mReadData == nullptr) finishTransfer();
+    }
+}
+
+void Spi::finishTransfer()
+{
+    Transfer* t;
+    if (mTransferBuffer.pop(t))
+    {
+        releaseDma();
+        if (t->mChipSelect != nullptr) t->mChipSelect->deselect();
+        if (t->mEvent != nullptr)
         {
-            mTransferBuffer.pop(t);
-            if (t->mChipSelect != nullptr) t->mChipSelect->deselect();
-            if (t->mEvent != nullptr) System::instance()->postEvent(t->mEvent);
-            nextTransfer();
+            t->mEvent->setResult(System::Event::Result::Success);
+            System::instance()->postEvent(t->mEvent);
         }
+        nextTransfer();
     }
 }
 
@@ -6,6 +6,7 @@
 #include "Dma.h"
 #include "Gpio.h"
 #include "Device.h"
+#include "CircularBuffer.h"
 
 class Spi : public Device, public ClockControl::Callback
 {
@@ -60,9 +61,13 @@ public:
     virtual void enable(Device::Part part);
     virtual void disable(Device::Part part);
 
+    // Uses DMA if streams are configured (and free, with a DmaManager), the interrupt set by configInterrupt() otherwise.
+    // Without an interrupt, a transfer that gets no streams fails with Result::Busy.
     bool transfer(Transfer* transfer);
 
     void configDma(Dma::Stream *write, Dma::Stream *read);
+
+    using Device::configDma;
 protected:
     virtual void clockCallback(ClockControl::Callback::Reason reason, uint32_t newClock);
     virtual void interruptCallback(InterruptController::Index index);
@@ -153,13 +158,15 @@ private:
     ClockControl* mClockControl;
     ClockControl::ClockSpeed mClock;
     uint32_t mSpeed;
-    CircularBuffer<Transfer*> mTransferBuffer;
+    CircularBuffer<Transfer*, 64> mTransferBuffer;
+    unsigned mPosition;
 
     void waitTransmitComplete();
     void waitReceiveNotEmpty();
     uint32_t setSpeed(uint32_t maxSpeed);
     void config(Spi::ClockPolarity clockPolarity, Spi::ClockPhase clockPhase, Spi::Endianess endianess);
     void nextTransfer();
+    void finishTransfer();
     void writeSync();
 };
 
@@ -0,0 +1,155 @@
+/*
+ * (c) 2012 Thomas Wihl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "StreamMux.h"
+
+#include <cstring>
+
+StreamMux::StreamMux(Stream &stream, Framing::Mode mode, unsigned maxPayload) :
+    mStream(stream),
+    mMode(mode),
+    mMaxPayload(maxPayload),
+    mFrame(new char[maxPayload + 1]),
+    mWritable(*this),
+    mWaiting(false),
+    mUnknownFrames(0)
+{
+    for (unsigned i = 0; i < MAX_CHANNELS; ++i) mChannel[i] = nullptr;
+    mStream.setFraming(mode, this, maxPayload + 1);
+}
+
+StreamMux::~StreamMux()
+{
+    for (unsigned i = 0; i < MAX_CHANNELS; ++i) delete mChannel[i];
+    delete[] mFrame;
+}
+
+StreamMux::Channel *StreamMux::addChannel(uint8_t id, unsigned priority, unsigned transmitBufferSize, unsigned receiveBufferSize)
+{
+    if (id >= MAX_CHANNELS || mChannel[id] != nullptr) return nullptr;
+    mChannel[id] = new Channel(*this, id, priority, transmitBufferSize, receiveBufferSize);
+    return mChannel[id];
+}
+
+void StreamMux::frameReceived(const char *data, unsigned len)
+{
+    Channel* channel = len != 0 ? this->channel(static_cast<uint8_t>(data[0])) : nullptr;
+    if (channel == nullptr)
+    {
+        ++mUnknownFrames;
+        return;
+    }
+    channel->received(data + 1, len - 1);
+}
+
+void StreamMux::eventCallback(System::Event */*event*/)
+{
+    mWaiting = false;
+    transmit();
+}
+
+// Writes of the current event get batched into one frame, the channels only ask for a transmit() later.
+void StreamMux::schedule()
+{
+    if (mWaiting) return;
+    mWaiting = true;
+    System::instance()->postEvent(&mWritable);
+}
+
+// Keeps at most FRAMES_QUEUED frames in the stream, so a frame of a channel on top only waits behind those.
+void StreamMux::transmit()
+{
+    if (mWaiting) return;
+    unsigned frameSize = Framing::maxEncodedSize(mMode, mMaxPayload + 1);
+    unsigned size = mStream.transmitBufferSize();
+    // Free space that leaves room for one more frame, the whole FIFO if it can't hold FRAMES_QUEUED.
+    unsigned room = size > FRAMES_QUEUED * frameSize ? size - (FRAMES_QUEUED - 1) * frameSize : size;
+    for (;;)
+    {
+        Channel* next = nullptr;
+        for (unsigned i = 0; i < MAX_CHANNELS; ++i)
+        {
+            Channel* channel = mChannel[i];
+            if (channel != nullptr && channel->mWriteFifo.used() != 0 && (next == nullptr || channel->mPriority < next->mPriority)) next = channel;
+        }
+        if (next == nullptr) return;
+        if (size - mStream.transmitPending() < room)
+        {
+            // The choice is made again then, a channel of higher priority may have data by that time.
+            mWaiting = true;
+            mStream.notifyWritable(room, &mWritable);
+            return;
+        }
+        CircularBuffer<char>::Region first, second;
+        unsigned len = std::min(next->mWriteFifo.peekRead(first, second), mMaxPayload);
+        unsigned firstLen = std::min(len, first.len);
+        mFrame[0] = static_cast<char>(next->mId);
+        memcpy(mFrame + 1, first.data, firstLen);
+        memcpy(mFrame + 1 + firstLen, second.data, len - firstLen);
+        // Only fails if the stream can't hold a frame, which the constructor requires.
+        if (!mStream.writeFrame(mFrame, len + 1)) return;
+        next->mWriteFifo.consume(len);
+    }
+}
+
+StreamMux::Channel::Channel(StreamMux &mux, uint8_t id, unsigned priority, unsigned transmitBufferSize, unsigned receiveBufferSize) :
+    mMux(mux),
+    mId(id),
+    mPriority(priority),
+    mWriteFifo(transmitBufferSize),
+    mReadFifo(receiveBufferSize),
+    mReadData(nullptr),
+    mReadLen(0),
+    mReadEvent(nullptr),
+    mDroppedBytes(0)
+{
+}
+
+int StreamMux::Channel::write(const char *data, unsigned len)
+{
+    unsigned written = mWriteFifo.write(data, len);
+    mMux.schedule();
+    return written;
+}
+
+int StreamMux::Channel::read(char *data, unsigned len)
+{
+    return mReadFifo.read(data, len);
+}
+
+int StreamMux::Channel::read(char *data, unsigned len, System::Event *event)
+{
+    if (event == nullptr || mReadFifo.used() >= len) return read(data, len);
+    event->setResult(System::Event::Result::Success);
+    mReadData = data;
+    mReadLen = len;
+    mReadEvent = event;
+    return 0;
+}
+
+void StreamMux::Channel::received(const char *data, unsigned len)
+{
+    mDroppedBytes += len - mReadFifo.write(data, len);
+    if (mReadEvent != nullptr && mReadFifo.used() >= mReadLen)
+    {
+        mReadFifo.read(mReadData, mReadLen);
+        System::Event* event = mReadEvent;
+        mReadEvent = nullptr;
+        System::instance()->postEvent(event);
+    }
+}
@@ -0,0 +1,106 @@
+/*
+ * (c) 2012 Thomas Wihl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef STREAMMUX_H
+#define STREAMMUX_H
+
+#include "stream.h"
+
+#include <cstdint>
+
+// Several logical channels over one Stream, each frame carries the channel id in its first byte followed by up to
+// maxPayload bytes of one channel. Each channel has its own FIFOs, the transmit side always sends from the channel
+// with the highest priority (lowest number) that has data, so a busy channel of high priority starves the others.
+// The frames are small enough to keep the latency of the channels on top low. Everything runs in the event loop,
+// so the channels must not be used from interrupt handlers. tools/muxdemux.cpp is the counterpart on the host.
+class StreamMux : public Stream::FrameCallback, public System::Event::Callback
+{
+public:
+    class Channel
+    {
+    public:
+        // Queues what fits into the channel's transmit FIFO, returns the count. The frames are built later from
+        // the event loop, so small writes of one event go out together.
+        int write(const char* data, unsigned len);
+        // Returns what is available right away, never blocks.
+        int read(char* data, unsigned len);
+        // Returns len if enough is available, posts the event once it is otherwise and returns 0.
+        // len must not exceed the receive FIFO.
+        int read(char* data, unsigned len, System::Event* event);
+
+        uint8_t id() const { return mId; }
+        // Received bytes lost because the receive FIFO was full.
+        unsigned droppedBytes() const { return mDroppedBytes; }
+
+    private:
+        friend class StreamMux;
+        Channel(StreamMux& mux, uint8_t id, unsigned priority, unsigned transmitBufferSize, unsigned receiveBufferSize);
+
+        StreamMux& mMux;
+        uint8_t mId;
+        unsigned mPriority;
+        CircularBuffer<char> mWriteFifo;
+        CircularBuffer<char> mReadFifo;
+        char* mReadData;
+        unsigned mReadLen;
+        System::Event* mReadEvent;
+        unsigned mDroppedBytes;
+
+        void received(const char* data, unsigned len);
+    };
+
+    // At most FRAMES_QUEUED frames wait in the stream, one being sent and the next.
+    enum { MAX_CHANNELS = 8, DEFAULT_PAYLOAD = 64, FRAMES_QUEUED = 2 };
+
+    // Takes over the framing and the write event of the stream, don't write to it directly anymore.
+    // Its transmit FIFO has to hold at least one encoded frame of maxPayload bytes.
+    StreamMux(Stream& stream, Framing::Mode mode = Framing::Mode::Cobs, unsigned maxPayload = DEFAULT_PAYLOAD);
+    ~StreamMux();
+
+    // Returns nullptr if the id is out of range or already used.
+    Channel* addChannel(uint8_t id, unsigned priority, unsigned transmitBufferSize, unsigned receiveBufferSize);
+    Channel* channel(uint8_t id) const { return id < MAX_CHANNELS ? mChannel[id] : nullptr; }
+
+    // Frames for channels we don't have.
+    unsigned unknownFrames() const { return mUnknownFrames; }
+
+    virtual const char* name() const { return "StreamMux"; }
+
+protected:
+    // Stream::FrameCallback interface
+    virtual void frameReceived(const char* data, unsigned len);
+    // System::Event::Callback interface, the stream has room for the next frame.
+    virtual void eventCallback(System::Event* event);
+
+private:
+    Stream& mStream;
+    Framing::Mode mMode;
+    unsigned mMaxPayload;
+    Channel* mChannel[MAX_CHANNELS];
+    // Channel id and payload of the frame being sent.
+    char* mFrame;
+    // Posted by schedule() or by the stream once it has room, mWaiting while either is pending.
+    System::Event mWritable;
+    bool mWaiting;
+    unsigned mUnknownFrames;
+
+    void schedule();
+    void transmit();
+};
+
+#endif // STREAMMUX_H
@@ -15,9 +15,10 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  *
  */
-
 #include "SysTickControl.h"
+#include "atomic.h"
 
+const unsigned SysTickControl::MAX_TIMER_MS;
 
 SysTickControl::SysTickControl(System::BaseAddress base, ClockControl *clock) :
     mBase(reinterpret_cast<volatile STK*>(base)),
@@ -25,12 +26,20 @@ SysTickControl::SysTickControl(System::BaseAddress base, ClockControl *clock) :
     mSingleCountTime(1),
     mCountPerMs(1),
     mMilliseconds(0),
-    mNextTick(-1)
+    mNextTick(-1),
+    mPeriodOffset(0),
+    mSequence(0),
+    mSuspendedMs(0),
+    mWheelTime(1)
 {
     static_assert(sizeof(STK) == 0x10, "Struct has wrong size, compiler problem.");
+    for (unsigned i = 0; i < LEVEL_COUNT * SLOT_COUNT; ++i) mSlot[i] = nullptr;
+    for (unsigned i = 0; i < LEVEL_COUNT; ++i) mSlotUsed[i] = 0;
     clock->addChangeHandler(this);
     config();
-    setNextTick(1000);
+    unsigned int primask = interrupt_disable();
+    setNextTick(1000, false);
+    interrupt_restore(primask);
 }
 
 void SysTickControl::enable()
@@ -44,19 +53,55 @@ void SysTickControl::disable()
     mBase->CTRL.ENABLE = 0;
 }
 
-void SysTickControl::setNextTick(unsigned ms)
+// The period ends ms after mMilliseconds. With carry, the counts since mMilliseconds are only read once the counter
+// stopped and are taken over into the new period, so the time spent reprogramming doesn't get lost.
+void SysTickControl::setNextTick(unsigned ms, bool carry)
 {
+    // RELOAD has only 24 bits
+    if (ms > 0x1000000 / mCountPerMs) ms = 0x1000000 / mCountPerMs;
+    ++mSequence;
     disable();
-    mBase->RELOAD = ms * mCountPerMs - 1;
+    uint32_t offset = carry ? elapsedCounts() : 0;
+    // If we got that late, the period ends with the next ms that leaves the counter something to count.
+    if (offset + 2 > ms * mCountPerMs) ms = (offset + 1) / mCountPerMs + 1;
+    mBase->RELOAD = ms * mCountPerMs - offset - 1;
     mNextTick = ms;
+    mPeriodOffset = offset;
     enable();
+    ++mSequence;
+}
+
+uint32_t SysTickControl::elapsedCounts()
+{
+    return mPeriodOffset + mBase->RELOAD - mBase->VAL;
+}
+
+void SysTickControl::startTimer(TimerEvent *timer, unsigned ms, unsigned period)
+{
+    if (ms > MAX_TIMER_MS) ms = MAX_TIMER_MS;
+    if (period > MAX_TIMER_MS) period = MAX_TIMER_MS;
+    unsigned int primask = interrupt_disable();
+    if (timer->active()) remove(timer);
+    timer->mExpires = mMilliseconds + elapsedCounts() / mCountPerMs + ms;
+    timer->mPeriod = period;
+    insert(timer);
+    // The tick is programmed for the earliest timer, so only a timer expiring before it needs a new one.
+    if (static_cast<int32_t>(timer->mExpires - (mMilliseconds + mNextTick)) < 0) reprogram();
+    interrupt_restore(primask);
+}
+
+void SysTickControl::cancelTimer(TimerEvent *timer)
+{
+    unsigned int primask = interrupt_disable();
+    if (timer->active()) remove(timer);
+    interrupt_restore(primask);
 }
 
 void SysTickControl::addRepeatingEvent(SysTickControl::RepeatingEvent *event)
 {
     if (event != nullptr)
     {
-        mRepeatingEvents.push_back(event);
+        startTimer(event, event->ms(), event->ms());
     }
 }
 
@@ -64,45 +109,202 @@ void SysTickControl::removeRepeatingEvent(SysTickControl::RepeatingEvent *event)
 {
     if (event != nullptr)
     {
-
-        //mRepeatingEvents.erase();
+        cancelTimer(event);
     }
 }
 
 // IRQ callback
 void SysTickControl::tick()
 {
-    unsigned nextTick = 1000;
+    unsigned int primask = interrupt_disable();
+    // The counter kept running since it reloaded (which takes a count itself) and made the interrupt pending.
+    uint32_t counts = mBase->RELOAD - mBase->VAL + 1;
+    System::instance()->reportLatency(static_cast<uint64_t>(counts) * mSingleCountTime / 1024);
     mMilliseconds += mNextTick;
-    for (auto& iter : mRepeatingEvents)
+    mPeriodOffset = 1;
+    reprogram();
+    interrupt_restore(primask);
+}
+
+// Moves the whole ms passed in the current period to mMilliseconds and starts a new period ending with the next
+// timer. The counts of the ms just begun stay in mPeriodOffset, so neither ns() nor the timers lose time.
+void SysTickControl::reprogram()
+{
+    unsigned ms = elapsedCounts() / mCountPerMs;
+    mPeriodOffset -= ms * mCountPerMs;
+    advance(ms, true);
+}
+
+void SysTickControl::advance(unsigned ms, bool carry)
+{
+    mMilliseconds += ms;
+    runTimers();
+    uint32_t next;
+    if (!nextExpiry(next)) next = mMilliseconds + MAX_TIMER_MS;
+    setNextTick(next - mMilliseconds, carry);
+}
+
+unsigned SysTickControl::msUntilNextEvent()
+{
+    uint32_t next;
+    if (!nextExpiry(next)) return -1;
+    uint32_t now = mMilliseconds + elapsedCounts() / mCountPerMs;
+    return static_cast<int32_t>(next - now) > 0 ? next - now : 0;
+}
+
+// Must be called with interrupts disabled, until the matching resume().
+void SysTickControl::suspend()
+{
+    disable();
+    // Round up, so ns() doesn't go backwards after resume().
+    mSuspendedMs = (elapsedCounts() + mCountPerMs - 1) / mCountPerMs;
+}
+
+// tickPending tells us the counter wrapped before we could suspend it, its interrupt must have been cleared.
+void SysTickControl::resume(unsigned elapsedMs, bool tickPending)
+{
+    advance(mSuspendedMs + elapsedMs + (tickPending ? mNextTick : 0), false);
+}
+
+void SysTickControl::insert(TimerEvent *timer)
+{
+    uint32_t expires = timer->mExpires;
+    int32_t delta = expires - mWheelTime;
+    if (delta < 0)
+    {
+        // Already due, goes into the slot processed next.
+        expires = mWheelTime;
+        delta = 0;
+    }
+    unsigned level = 0;
+    while (level < LEVEL_COUNT - 1 && (static_cast<uint32_t>(delta) >> ((level + 1) * LEVEL_BITS)) != 0) ++level;
+    unsigned index = (expires >> (level * LEVEL_BITS)) & SLOT_MASK;
+    unsigned slot = level * SLOT_COUNT + index;
+    timer->mSlot = slot;
+    timer->mNext = mSlot[slot];
+    if (timer->mNext != nullptr) timer->mNext->mPrev = &timer->mNext;
+    timer->mPrev = &mSlot[slot];
+    mSlot[slot] = timer;
+    mSlotUsed[level] |= 1ULL << index;
+}
+
+void SysTickControl::remove(TimerEvent *timer)
+{
+    *timer->mPrev = timer->mNext;
+    if (timer->mNext != nullptr) timer->mNext->mPrev = timer->mPrev;
+    if (mSlot[timer->mSlot] == nullptr) mSlotUsed[timer->mSlot / SLOT_COUNT] &= ~(1ULL << (timer->mSlot % SLOT_COUNT));
+    timer->mNext = nullptr;
+    timer->mPrev = nullptr;
+}
+
+// All timers of this slot expire within the level below, redistribute them there.
+void SysTickControl::cascade(unsigned level, unsigned index)
+{
+    unsigned slot = level * SLOT_COUNT + index;
+    TimerEvent* timer = mSlot[slot];
+    mSlot[slot] = nullptr;
+    mSlotUsed[level] &= ~(1ULL << index);
+    while (timer != nullptr)
+    {
+        TimerEvent* next = timer->mNext;
+        insert(timer);
+        timer = next;
+    }
+}
+
+void SysTickControl::expire(unsigned index)
+{
+    TimerEvent* timer = mSlot[index];
+    mSlot[index] = nullptr;
+    mSlotUsed[0] &= ~(1ULL << index);
+    while (timer != nullptr)
     {
-        iter->millisecondsPassed(mNextTick);
-        if (iter->msRemain() < nextTick) nextTick = iter->msRemain();
+        TimerEvent* next = timer->mNext;
+        timer->mNext = nullptr;
+        timer->mPrev = nullptr;
+        System::instance()->postEvent(timer);
+        if (timer->mPeriod != 0)
+        {
+            // Keep the phase, but skip the periods we missed (e.g. in stop mode), the event is only posted once.
+            timer->mExpires += timer->mPeriod;
+            if (static_cast<int32_t>(timer->mExpires - mMilliseconds) <= 0)
+            {
+                timer->mExpires += ((mMilliseconds - timer->mExpires) / timer->mPeriod + 1) * timer->mPeriod;
+            }
+            insert(timer);
+        }
+        timer = next;
     }
-    setNextTick(nextTick);
+}
+
+// Processes the wheel up to mMilliseconds, only stopping where a slot of any level starts that is used, so after a
+// long stop the empty stretches are skipped instead of walked in steps of 64ms.
+void SysTickControl::runTimers()
+{
+    while (static_cast<int32_t>(mMilliseconds - mWheelTime) >= 0)
+    {
+        uint32_t time = mWheelTime;
+        for (unsigned level = 1; level < LEVEL_COUNT && (time & ((1U << (level * LEVEL_BITS)) - 1)) == 0; ++level)
+        {
+            cascade(level, (time >> (level * LEVEL_BITS)) & SLOT_MASK);
+        }
+        unsigned index = time & SLOT_MASK;
+        if (mSlotUsed[0] & (1ULL << index)) expire(index);
+        mWheelTime = time + 1;
+        uint32_t next;
+        if (!nextExpiry(next) || static_cast<int32_t>(next - mMilliseconds) > 0) next = mMilliseconds + 1;
+        mWheelTime = next;
+    }
+}
+
+// Returns the start of the first used slot, which is when its timers expire (level 0) or get cascaded.
+bool SysTickControl::nextExpiry(uint32_t &time)
+{
+    bool found = false;
+    uint32_t best = 0;
+    for (unsigned level = 0; level < LEVEL_COUNT; ++level)
+    {
+        uint64_t used = mSlotUsed[level];
+        if (used == 0) continue;
+        unsigned shift = level * LEVEL_BITS;
+        unsigned current = (mWheelTime >> shift) & SLOT_MASK;
+        // The current slot of a higher level has already been cascaded, unless we are right at its start.
+        unsigned first = (mWheelTime & ((1U << shift) - 1)) == 0 ? current : current + 1;
+        uint64_t ahead = first < SLOT_COUNT ? used & ~((1ULL << first) - 1) : 0;
+        uint32_t base = mWheelTime & ~((1U << (shift + LEVEL_BITS)) - 1);
+        uint32_t start;
+        if (ahead != 0) start = base + (__builtin_ctzll(ahead) << shift);
+        else start = base + (1U << (shift + LEVEL_BITS)) + (__builtin_ctzll(used) << shift);
+        if (!found || start - mWheelTime < best - mWheelTime) best = start;
+        found = true;
+    }
+    time = best;
+    return found;
 }
 
 void SysTickControl::usleep(unsigned int us)
 {
-    uint64_t start = ns() / 1000;
-    uint64_t current = start;
-    do
+    System* system = System::instance();
+    uint64_t start = system->timestamp();
+    uint64_t duration = static_cast<uint64_t>(us) * 1000;
+    while (system->timestamp() - start < duration)
     {
-        current = ns() / 1000;
-    }   while (current - start < us);
+    }
 }
 
 uint64_t SysTickControl::ns()
 {
     uint32_t ms;
     uint32_t count;
+    unsigned sequence;
     do
     {
+        sequence = mSequence;
         mBase->CTRL.COUNTFLAG = 0;
-        count = mBase->VAL;
+        count = mPeriodOffset + mBase->RELOAD - mBase->VAL;
         ms = mMilliseconds;
-    }   while (mBase->CTRL.COUNTFLAG);
-    uint64_t val = mBase->RELOAD - count;
+    }   while (mBase->CTRL.COUNTFLAG || sequence != mSequence);
+    uint64_t val = count;
     val *= mSingleCountTime;
     val /= 1024;
     val += ms * static_cast<uint64_t>(1000000);
@@ -121,16 +323,3 @@ void SysTickControl::config()
     mBase->CTRL.CLKSOURCE = 0;
     mBase->CTRL.TICKINT = 1;
 }
-
-
-
-void SysTickControl::RepeatingEvent::millisecondsPassed(unsigned ms)
-{
-    mMsFromStart += ms;
-    if (mMsFromStart >= mMs)
-    {
-        System::instance()->postEvent(this);
-        mMsFromStart -= mMs;
-        if (mMsFromStart >= mMs) mMsFromStart = 0;
-    }
-}
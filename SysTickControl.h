@@ -15,7 +15,6 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  *
  */
-
 #ifndef SYSTICKCONTROL_H
 #define SYSTICKCONTROL_H
 
@@ -26,29 +25,55 @@
 class SysTickControl : ClockControl::Callback
 {
 public:
-    class RepeatingEvent : public System::Event
+    // A timer is embedded in its owner and posted as event when it expires, starting and cancelling it is O(1).
+    class TimerEvent : public System::Event
+    {
+    public:
+        TimerEvent(Callback& callback, Priority priority = Priority::Normal) : System::Event(callback, priority), mNext(nullptr), mPrev(nullptr), mExpires(0), mPeriod(0), mSlot(0)
+        { }
+
+        bool active() const { return mPrev != nullptr; }
+        unsigned period() const { return mPeriod; }
+    private:
+        friend class SysTickControl;
+        TimerEvent* mNext;
+        TimerEvent** mPrev;
+        uint32_t mExpires;
+        unsigned mPeriod;
+        uint16_t mSlot;
+    };
+
+    class RepeatingEvent : public TimerEvent
     {
     public:
-        RepeatingEvent(Callback& callback, int ms) : System::Event(callback), mMs(ms), mMsFromStart(0)
+        RepeatingEvent(Callback& callback, int ms, Priority priority = Priority::Normal) : TimerEvent(callback, priority), mMs(ms)
         { }
 
-        void millisecondsPassed(unsigned ms);
         unsigned ms() const { return mMs; }
-        unsigned msRemain() const { return mMs - mMsFromStart; }
     private:
         unsigned mMs;
-
-        unsigned mMsFromStart;
     };
 
+    // Longest time a timer can be started for (about 12 days).
+    static const unsigned MAX_TIMER_MS = (1U << 30) - 1;
+
     SysTickControl(System::BaseAddress base, ClockControl* clock);
     ~SysTickControl() { disable(); }
 
+    // Fires once after ms, and then every period ms if period is not 0. Restarts the timer if it is already active.
+    void startTimer(TimerEvent* timer, unsigned ms, unsigned period = 0);
+    void cancelTimer(TimerEvent* timer);
+
     void addRepeatingEvent(RepeatingEvent* event);
     void removeRepeatingEvent(RepeatingEvent* event);
 
     void tick();
 
+    // Tickless idle: the tick is stopped by suspend() and resume() accounts for the time spent without it.
+    unsigned msUntilNextEvent();
+    void suspend();
+    void resume(unsigned elapsedMs, bool tickPending);
+
     void usleep(unsigned int us);
     uint64_t ns();
 
@@ -77,18 +102,40 @@ private:
             uint32_t NOREF : 1;
         }   CALIB;
     };
+
+    // Hierarchical timer wheel: level n has 64 slots of 64^n ms each, a timer is kept in the lowest level its
+    // remaining time fits in and moved down (cascaded) when the ms counter reaches the start of its slot.
+    enum { LEVEL_BITS = 6, SLOT_COUNT = 1 << LEVEL_BITS, SLOT_MASK = SLOT_COUNT - 1, LEVEL_COUNT = 5 };
+
     volatile STK* mBase;
     ClockControl* mClock;
     unsigned mSingleCountTime;
     uint32_t mCountPerMs;
-    unsigned mMilliseconds;
+    volatile unsigned mMilliseconds;
     unsigned mNextTick;
-    std::vector<RepeatingEvent*> mRepeatingEvents;
+    // Counts already elapsed when the current period started, see reprogram()
+    volatile uint32_t mPeriodOffset;
+    volatile unsigned mSequence;
+    unsigned mSuspendedMs;
+    // Next ms to be processed, all timers expiring before have been posted.
+    uint32_t mWheelTime;
+    TimerEvent* mSlot[LEVEL_COUNT * SLOT_COUNT];
+    uint64_t mSlotUsed[LEVEL_COUNT];
 
     void config();
     void enable();
     void disable();
-    void setNextTick(unsigned ms);
+    void setNextTick(unsigned ms, bool carry);
+    void advance(unsigned ms, bool carry);
+    void reprogram();
+    uint32_t elapsedCounts();
+
+    void insert(TimerEvent* timer);
+    void remove(TimerEvent* timer);
+    void cascade(unsigned level, unsigned index);
+    void expire(unsigned index);
+    void runTimers();
+    bool nextExpiry(uint32_t& time);
 };
 
 #endif // SYSTICKCONTROL_H
@@ -18,6 +18,13 @@
 
 #include "System.h"
 #include "ClockControl.h"
+#include "Kernel.h"
+#include "SysTickControl.h"
+#include "Power.h"
+#include "Rtc.h"
+#include "CycleCounter.h"
+#include "HighResTimer.h"
+#include "atomic.h"
 
 #include <cstdio>
 #include <cstring>
@@ -63,9 +70,12 @@ void __attribute__((interrupt)) Isr()
     System::instance()->handleInterrupt();
 }
 
+// Context switch of the kernel, see Kernel.cpp
+extern void PendSV();
+
 void __attribute__((interrupt)) SysTick()
 {
-    System::instance()->handleSysTick();
+    System::instance()->handleInterrupt();
 }
 
 extern void (* const gIsrVectorTable[])(void);
@@ -73,7 +83,7 @@ __attribute__ ((section(".isr_vector_table")))
 void (* const gIsrVectorTable[])(void) = {
         // 16 trap functions for ARM
         (void (* const)())&__stack_end, (void (* const)())&_start, Trap, Trap, Trap, Trap, Trap, 0,
-0, 0, 0, Trap, Trap, 0, Trap, SysTick,
+0, 0, 0, Trap, Trap, 0, PendSV, SysTick,
 // 82 hardware interrupts specific to the STM32F407
 Isr, Isr, Isr, Isr, Isr, Isr, Isr, Isr, Isr, Isr,
 Isr, Isr, Isr, Isr, Isr, Isr, Isr, Isr, Isr, Isr,
@@ -243,14 +253,29 @@ const unsigned int System::STACK_MAGIC;
 
 void System::initStack()
 {
-    unsigned int* p = reinterpret_cast<unsigned int*>(&__stack_start);
     register unsigned int* stackPointer __asm("sp");
-    for (; p < stackPointer; ++p)
+    fillStack(reinterpret_cast<unsigned int*>(&__stack_start), stackPointer);
+}
+
+void System::fillStack(unsigned int *start, unsigned int *end)
+{
+    for (unsigned int* p = start; p < end; ++p)
     {
         *p = STACK_MAGIC;
     }
 }
 
+// Returns the number of bytes at the bottom of the stack never written to (still containing the magic value).
+uint32_t System::stackUnused(const unsigned int *start, const unsigned int *end)
+{
+    const unsigned int* p = start;
+    for (; p < end; ++p)
+    {
+        if (*p != STACK_MAGIC) break;
+    }
+    return (p - start) * sizeof(unsigned int);
+}
+
 
 char* System::increaseHeap(unsigned int incr)
 {
@@ -322,23 +347,117 @@ uint64_t System::timeInEvent()
 }
 
 
+// Can be called from any interrupt priority, a full queue is only counted (see eventOverflowCount()).
 void System::postEvent(Event *event)
 {
-    __asm("cpsid i");
-    if (!mSystem->mEventQueue.push(event)) printf("Could not push event %p.\n", event);
-    __asm("cpsie i");
+    mSystem->mEventQueue[static_cast<int>(event->priority())].push(event);
+    if (mSystem->mKernel != nullptr) mSystem->mKernel->eventPosted();
 }
 
 bool System::waitForEvent(Event *&event)
 {
     uint64_t start = ns();
-    while (mEventQueue.used() == 0)
+    while (!popEvent(event))
     {
-        __asm("wfi");
+        // The kernel lets other threads run until an event gets posted.
+        if (mKernel != nullptr)
+        {
+            mKernel->prepareWaitForEvent();
+            if (eventQueueEmpty()) mKernel->waitForEvent();
+            else mKernel->cancelWaitForEvent();
+        }
+        else idle();
     }
     ++mEventCount;
     mTimeIdle += ns() - start;
-    return mEventQueue.pop(event);
+    return true;
+}
+
+bool System::popEvent(Event *&event)
+{
+    for (int i = 0; i < Event::PRIORITY_COUNT; ++i)
+    {
+        if (mEventQueue[i].pop(event)) return true;
+    }
+    return false;
+}
+
+bool System::eventQueueEmpty()
+{
+    for (int i = 0; i < Event::PRIORITY_COUNT; ++i)
+    {
+        if (mEventQueue[i].used() != 0) return false;
+    }
+    return true;
+}
+
+void System::configTickless(SysTickControl *sysTick, Power *power, Rtc *rtc, unsigned int stopThresholdMs)
+{
+    mSysTick = sysTick;
+    mPower = power;
+    mRtc = rtc;
+    mStopThreshold = stopThresholdMs;
+}
+
+// SysTickControl only interrupts when the next repeating event is due (or after a second at most),
+// so sleeping until the next interrupt is all we have to do unless stop mode is worth it.
+void System::idle()
+{
+    // Stop mode would also stop the high resolution timer.
+    bool highResPending = mHighResTimer != nullptr && mHighResTimer->pending() != 0;
+    if (mSysTick != nullptr && mPower != nullptr && mRtc != nullptr && !highResPending && mSysTick->msUntilNextEvent() >= mStopThreshold && stop()) return;
+    uint64_t start = ns();
+    // Every exception return sets the event register, so an event posted after the pop in waitForEvent()
+    // makes wfe return immediately instead of sleeping until the next interrupt.
+    __asm("wfe");
+    mTimeSleep += ns() - start;
+}
+
+// In stop mode all clocks but the RTC stop, so the tick gets suspended and corrected afterwards from the
+// RTC time. Returns false if we didn't stop, because something happened in the meantime.
+bool System::stop()
+{
+    unsigned int primask = interrupt_disable();
+    if (!eventQueueEmpty() || mBase->ICSR.PENDSTSET)
+    {
+        interrupt_restore(primask);
+        return false;
+    }
+    unsigned int ms = mSysTick->msUntilNextEvent();
+    if (ms > mRtc->maxWakeupMs()) ms = mRtc->maxWakeupMs();
+    uint32_t clock = mRcc->clock(ClockControl::ClockSpeed::System);
+    mSysTick->suspend();
+    if (mBase->ICSR.PENDSTSET)
+    {
+        // The tick wrapped while we suspended it, account for it here instead of its interrupt.
+        setRegister(&mBase->ICSR, 1 << 25);
+        mSysTick->resume(0, true);
+        interrupt_restore(primask);
+        return false;
+    }
+    mRtc->startWakeup(ms);
+    uint32_t before = mRtc->milliseconds();
+    mPower->clearWakeupFlag();
+    mBase->SCR.SLEEPDEEP = 1;
+    // With interrupts masked wfi still returns on a pending interrupt, which then runs after we restored the clocks.
+    __asm("wfi");
+    mBase->SCR.SLEEPDEEP = 0;
+    uint32_t elapsed = Rtc::msBetween(before, mRtc->milliseconds());
+    mRtc->stopWakeup();
+    // We always wake up running from HSI, restart the PLL if we used it.
+    if (mRcc->clock(ClockControl::ClockSpeed::System) != clock) mRcc->setSystemClock(clock);
+    mSysTick->resume(elapsed, false);
+    mTimeStop += elapsed * static_cast<uint64_t>(1000000);
+    ++mStopCount;
+    interrupt_restore(primask);
+    return true;
+}
+
+uint32_t System::eventOverflowCount()
+{
+    uint32_t count = 0;
+    for (int i = 0; i < Event::PRIORITY_COUNT; ++i) count += mEventQueue[i].overflowCount();
+    return count;
 }
 
 void System::updateBogoMips()
@@ -352,6 +471,99 @@ void System::updateBogoMips()
     mBogoMips = 100000000000000LL / (end - start);
 }
 
+// The wake up comes from the high resolution timer if set, from the SysTick timers passed to configTickless()
+// otherwise. The events handled meanwhile may call sleep() again, the caller has to cope with that.
+// With the kernel running, the event thread keeps handling events but lets other threads run while the queue is empty.
+// Any other thread blocks until the event thread handled its wake up event.
+void System::sleep(unsigned int us)
+{
+    class WakeUp : public Event::Callback
+    {
+    public:
+        WakeUp() : mDone(false), mSemaphore(nullptr) { }
+        virtual void eventCallback(Event* /*event*/)
+        {
+            mDone = true;
+            // Last, the sleeping thread may run and leave sleep() right away.
+            if (mSemaphore != nullptr) mSemaphore->post();
+        }
+        virtual const char* name() const { return "sleep"; }
+        volatile bool mDone;
+        Kernel::Semaphore* mSemaphore;
+    };
+
+    if (inInterrupt())
+    {
+        usleep(us);
+        return;
+    }
+    WakeUp wakeUp;
+    Kernel::Semaphore semaphore(0, 1);
+    bool block = mKernel != nullptr && !mKernel->inMainThread();
+    if (block) wakeUp.mSemaphore = &semaphore;
+    SysTickControl::TimerEvent event(wakeUp, Event::Priority::High);
+    event.setResult(Event::Result::Success);
+    uint64_t end = ns() + static_cast<uint64_t>(us) * 1000;
+    if (mHighResTimer == nullptr || !mHighResTimer->sleepFor(&event, us))
+    {
+        if (mSysTick == nullptr)
+        {
+            // Nothing to wake us up, other threads at least get the CPU.
+            if (mKernel != nullptr)
+            {
+                while (ns() < end) mKernel->yield();
+            }
+            else usleep(us);
+            return;
+        }
+        // One more, the current ms is already partly over.
+        mSysTick->startTimer(&event, (us + 999) / 1000 + 1);
+    }
+    if (block) semaphore.wait();
+    else
+    {
+        // Leave only after our event got handled, it must not stay queued when we return.
+        while (!wakeUp.mDone)
+        {
+            Event* next;
+            waitForEvent(next);
+            next->callback();
+        }
+    }
+    // The high resolution timer gave our deadline up for an earlier one, the rest is waited without it.
+    if (event.result() == Event::Result::Busy)
+    {
+        while (ns() < end)
+        {
+            if (block) mKernel->yield();
+            else yield();
+        }
+    }
+}
+
+// Unlike idle() this never enters stop mode, the peripheral the caller waits for needs its clock.
+void System::yield()
+{
+    if (inInterrupt()) return;
+    if (Kernel::running())
+    {
+        mKernel->yield();
+        return;
+    }
+    Event* event;
+    if (popEvent(event))
+    {
+        ++mEventCount;
+        event->callback();
+    }
+    else
+    {
+        uint64_t start = ns();
+        __asm("wfe");
+        mTimeSleep += ns() - start;
+    }
+}
+
 void System::nspin(uint16_t ns)
 {
     for (unsigned int i = mBogoMips / 100000 * ns / 1000; i != 0; --i)
@@ -435,21 +647,33 @@ void System::printInfo()
     std::printf("BOGOMIPS: %lu.%06lu\n", bogoMips() / 1000000, bogoMips() % 1000000);
     std::printf("RAM     : %luk heap free, %luk heap used, %luk bss used, %lik data used.\n", (memFree() + 512) / 1024, (memUsed() + 512) / 1024, (memBssUsed() + 512) / 1024, (memDataUsed() + 512) / 1024);
     std::printf("STACK   : %luk free, %luk used, %luk max used.\n", (stackFree() + 512) / 1024, (stackUsed() + 512) / 1024, (stackMaxUsed() + 512) / 1024);
+    std::printf("EVENTS  : %lu handled, %lu lost (queue full).\n", eventCount(), eventOverflowCount());
+    std::printf("IDLE    : %lums total, %lums sleep, %lums stop (%lu times).\n", static_cast<unsigned long>(mTimeIdle / 1000000),
+                static_cast<unsigned long>(mTimeSleep / 1000000), static_cast<unsigned long>(mTimeStop / 1000000), stopCount());
 }
 
 
 System::System(BaseAddress base, const BaseAddress *gpioArray, int gpioArraySize, BaseAddress clockControl) :
     mBase(reinterpret_cast<volatile SCB*>(base)),
     mBogoMips(0),
-    mEventQueue(128),
     mTimeInInterrupt(0),
     mTimeIdle(0),
+    mTimeSleep(0),
+    mTimeStop(0),
+    mStopCount(0),
     mEventCount(0),
     mInterruptCount(0),
     mGpio(nullptr),
     mGpioCount(gpioArraySize),
     mGpioIsEnabled(0),
-    mRcc(nullptr)
+    mRcc(nullptr),
+    mKernel(nullptr),
+    mSysTick(nullptr),
+    mPower(nullptr),
+    mRtc(nullptr),
+    mStopThreshold(0),
+    mCycleCounter(nullptr),
+    mHighResTimer(nullptr)
 {
     static_assert(sizeof(SCB) == 0x40, "Struct has wrong size, compiler problem.");
     // Make sure we are the first and only instance
@@ -474,7 +698,16 @@ System::System(BaseAddress base, const BaseAddress *gpioArray, int gpioArraySize
     if (clockControl != 0)
     {
         mRcc = new ClockControl(clockControl);
+#ifdef TIMEBASE_DWT
+        mCycleCounter = new CycleCounter(DWT_BASE, base + DEMCR_OFFSET, mRcc);
+#endif
     }
+#ifdef IRQ_STATISTICS
+    memset(mInterruptStatistics, 0, sizeof(mInterruptStatistics));
+#endif
+#ifdef EVENT_STATISTICS
+    resetCallbackStatistics();
+#endif
 }
 
 System::~System()
@@ -634,13 +867,110 @@ void System::handleTrap(TrapIndex index, unsigned int* stackPointer)
     }
 }
 
+void System::setTrapPriority(TrapIndex index, uint8_t priority)
+{
+    // SHPR holds one byte per trap, starting with MemManage
+    reinterpret_cast<volatile uint8_t*>(mBase->SHPR)[static_cast<int>(index) - 4] = priority;
+}
+
+uint64_t System::timestamp()
+{
+#ifdef TIMEBASE_DWT
+    if (mCycleCounter != nullptr && mCycleCounter->available()) return mCycleCounter->ns();
+#endif
+    return ns();
+}
+
+bool System::sleepUntil(Event *event, uint32_t us)
+{
+    return mHighResTimer != nullptr && mHighResTimer->sleepUntil(event, us);
+}
+
+bool System::sleepFor(Event *event, uint32_t us)
+{
+    return mHighResTimer != nullptr && mHighResTimer->sleepFor(event, us);
+}
+
+uint32_t System::microseconds()
+{
+    return mHighResTimer != nullptr ? mHighResTimer->now() : static_cast<uint32_t>(ns() / 1000);
+}
+
+// Called for SysTick and all peripheral interrupts, timing them also keeps the cycle counter from wrapping unnoticed.
 void System::handleInterrupt()
 {
-    uint64_t start = ns();
-    handleInterrupt(mBase->ICSR.VECTACTIVE - 16);
-    mTimeInInterrupt += ns() - start;
+    uint64_t start = timestamp();
+    unsigned int vector = mBase->ICSR.VECTACTIVE;
+    if (vector == 15) handleSysTick();
+    else handleInterrupt(vector - 16);
+    uint64_t duration = timestamp() - start;
+    mTimeInInterrupt += duration;
     ++mInterruptCount;
+#ifdef IRQ_STATISTICS
+    // A vector never preempts itself, so no locking needed, but nested interrupts are included in the duration.
+    InterruptStatistics& stat = mInterruptStatistics[vector];
+    ++stat.count;
+    stat.total += duration;
+    if (duration > stat.max) stat.max = duration;
+    unsigned int bits = 32 - __builtin_clz(static_cast<uint32_t>(duration) | 1);
+    unsigned int bucket = duration >= 0x100000000ULL ? InterruptStatistics::HISTOGRAM_SIZE - 1 : (bits <= 7 ? 0 : bits - 7);
+    if (bucket >= InterruptStatistics::HISTOGRAM_SIZE) bucket = InterruptStatistics::HISTOGRAM_SIZE - 1;
+    ++stat.histogram[bucket];
+#endif
+}
+
+#ifdef EVENT_STATISTICS
+void System::Event::callback()
+{
+    // The event may be gone once its callback returns (e.g. one living on the stack of the callback's caller).
+    Callback* callback = &mCallback;
+    uint64_t start = mSystem->timestamp();
+    callback->eventCallback(this);
+    mSystem->recordCallback(callback, mSystem->timestamp() - start);
+}
+
+// Open addressing on the callback address, events are only dispatched from one thread so no locking is needed.
+void System::recordCallback(Event::Callback *callback, uint64_t ns)
+{
+    unsigned int hash = reinterpret_cast<uintptr_t>(callback) >> 3;
+    for (unsigned int i = 0; i < CALLBACK_STATISTICS_SIZE; ++i)
+    {
+        CallbackStatistics& stat = mCallbackStatistics[(hash + i) % CALLBACK_STATISTICS_SIZE];
+        if (stat.callback == nullptr) stat.callback = callback;
+        if (stat.callback == callback)
+        {
+            ++stat.count;
+            stat.total += ns;
+            if (ns > stat.max) stat.max = ns;
+            return;
+        }
+    }
+    ++mCallbackStatisticsLost;
+}
+
+void System::resetCallbackStatistics()
+{
+    memset(mCallbackStatistics, 0, sizeof(mCallbackStatistics));
+    mCallbackStatisticsLost = 0;
+}
+#endif
+
+#ifdef IRQ_STATISTICS
+void System::resetInterruptStatistics()
+{
+    unsigned int primask = interrupt_disable();
+    memset(mInterruptStatistics, 0, sizeof(mInterruptStatistics));
+    interrupt_restore(primask);
+}
+
+void System::reportLatency(uint32_t ns)
+{
+    InterruptStatistics& stat = mInterruptStatistics[mBase->ICSR.VECTACTIVE];
+    ++stat.latencyCount;
+    stat.latencyTotal += ns;
+    if (ns > stat.latencyMax) stat.latencyMax = ns;
 }
+#endif
 
 void System::printWarning(const char *component, const char *message)
 {
@@ -20,7 +20,7 @@
 #define SYSTEM_H
 
 #include "ExternalInterrupt.h"
-#include "CircularBuffer.h"
+#include "MpscQueue.h"
 #include "Gpio.h"
 
 #include <cstdint>
@@ -44,6 +44,12 @@ extern void _start();
 }
 
 class ClockControl;
+class Kernel;
+class SysTickControl;
+class Power;
+class Rtc;
+class CycleCounter;
+class HighResTimer;
 
 class System
 {
@@ -52,21 +58,32 @@ public:
     {
     public:
         enum class Result { Success, Busy, ParityError, FramingError, NoiseDetected, OverrunError, LineBreak, CommandResponse, CommandSent, CommandCrcFail, CommandTimeout, DataSuccess, DataFail, Nack };
+        // Pending events of a higher priority are always handled first, within a priority in FIFO order.
+        enum class Priority { High, Normal, Low };
+        enum { PRIORITY_COUNT = 3 };
         class Callback
         {
         public:
             virtual void eventCallback(Event* event) = 0;
+            // Shown in the event statistics, which use the address of the callback otherwise.
+            virtual const char* name() const { return nullptr; }
         };
 
-        Event(Callback& callback) : mCallback(callback) { }
+        Event(Callback& callback, Priority priority = Priority::Normal) : mCallback(callback), mPriority(priority) { }
 
+#ifdef EVENT_STATISTICS
+        void callback();
+#else
         void callback() { mCallback.eventCallback(this); }
+#endif
 
         void setResult(Result result) { mResult = result; }
         Result result() { return mResult; }
+        Priority priority() const { return mPriority; }
     private:
         Result mResult;
         Callback& mCallback;
+        Priority mPriority;
     };
 
     enum class TrapIndex
@@ -80,18 +97,68 @@ public:
         PendSV = 14,
     };
 
+    enum class IdleMode { Sleep, Stop };
+
     typedef uint32_t BaseAddress;
 
+#ifdef IRQ_STATISTICS
+    // Per exception number, so SysTick (15) is included and peripheral interrupt n is found at 16 + n.
+    struct InterruptStatistics
+    {
+        // Bucket 0 counts handlers below 128ns, bucket n those below 2^(n + 7)ns, the last one all longer ones.
+        enum { HISTOGRAM_SIZE = 16 };
+        uint32_t count;
+        uint64_t total;
+        uint32_t max;
+        uint32_t latencyCount;
+        uint64_t latencyTotal;
+        uint32_t latencyMax;
+        uint32_t histogram[HISTOGRAM_SIZE];
+    };
+    enum { VECTOR_COUNT = 16 + 82 };
+#endif
+#ifdef EVENT_STATISTICS
+    // Time spent in Event::callback() per callback object.
+    struct CallbackStatistics
+    {
+        Event::Callback* callback;
+        uint32_t count;
+        uint64_t total;
+        uint32_t max;
+    };
+    enum { CALLBACK_STATISTICS_SIZE = 32 };
+#endif
+
     virtual void handleInterrupt(uint32_t index) = 0;
     virtual void consoleRead(char *msg, unsigned int len) = 0;
     virtual void consoleWrite(const char *msg, unsigned int len) = 0;
     virtual void handleSysTick() = 0;
+    // Busy waits, for short delays or where nothing else may run in between.
     virtual void usleep(unsigned int us) = 0;
+    // Waits at least us, handling pending events in the meantime and sleeping the core otherwise.
+    // Spins like usleep() inside interrupt handlers or without a wake up timer, see sleep() for details.
+    void sleep(unsigned int us);
+    // Handles one pending event or sleeps the core until the next interrupt, for loops waiting on a peripheral.
+    // Returns right away inside interrupt handlers, the caller spins there.
+    void yield();
+    bool inInterrupt() const { return mBase->ICSR.VECTACTIVE != 0; }
     virtual uint64_t ns() = 0;
+    // Cheap time in ns for measuring how long something runs, from the DWT cycle counter when built with
+    // TIMEBASE_DWT (and the core has one), from ns() otherwise. Doesn't advance while the core sleeps.
+    uint64_t timestamp();
+    // Posts event once the microsecond time of the high resolution timer reaches us, without blocking.
+    // Returns false if no such timer is set or too many deadlines are pending, see HighResTimer::sleepUntil().
+    bool sleepUntil(Event* event, uint32_t us);
+    bool sleepFor(Event* event, uint32_t us);
+    uint32_t microseconds();
+    void setHighResTimer(HighResTimer* timer) { mHighResTimer = timer; }
+    HighResTimer* highResTimer() const { return mHighResTimer; }
 
     static inline System* instance() { return mSystem; }
     static char* increaseHeap(unsigned int incr);
     static void initStack();
+    static void fillStack(unsigned int* start, unsigned int* end);
+    static uint32_t stackUnused(const unsigned int* start, const unsigned int* end);
     template <class T>
     static inline void setRegister(volatile T* reg, uint32_t value) { *reinterpret_cast<volatile uint32_t*>(reg) = value; }
 
@@ -115,10 +182,39 @@ public:
     uint64_t timeInInterrupt();
     uint64_t timeInEvent();
     uint32_t interruptCount() { return mInterruptCount; }
+#ifdef IRQ_STATISTICS
+    const InterruptStatistics& interruptStatistics(unsigned int vector) const { return mInterruptStatistics[vector]; }
+    void resetInterruptStatistics();
+    // For handlers that know when their interrupt got pending (e.g. from a counter value), records the time till it was served.
+    void reportLatency(uint32_t ns);
+#else
+    void reportLatency(uint32_t /*ns*/) { }
+#endif
+#ifdef EVENT_STATISTICS
+    const CallbackStatistics* callbackStatistics() const { return mCallbackStatistics; }
+    // Number of calls not recorded, because the table was full.
+    uint32_t callbackStatisticsLost() const { return mCallbackStatisticsLost; }
+    void resetCallbackStatistics();
+    void recordCallback(Event::Callback* callback, uint64_t ns);
+#endif
+    uint64_t timeIdle(IdleMode mode) { return mode == IdleMode::Stop ? mTimeStop : mTimeSleep; }
+    uint32_t stopCount() { return mStopCount; }
     uint32_t eventCount() { return mEventCount; }
+    uint32_t eventOverflowCount();
+    unsigned int eventQueueHighWater(Event::Priority priority) { return mEventQueue[static_cast<int>(priority)].highWater(); }
+    unsigned int eventQueueSize(Event::Priority priority) { return mEventQueue[static_cast<int>(priority)].size(); }
 
     void postEvent(Event* event);
     bool waitForEvent(Event*& event);
+    // Set by Kernel::start(), from then on waitForEvent() blocks the calling thread instead of the CPU.
+    void setKernel(Kernel* kernel) { mKernel = kernel; }
+    // Lets waitForEvent() stop the tick and, with power and rtc given, enter stop mode if the next repeating
+    // event is at least stopThresholdMs away. The stop mode itself is configured with Power::configStop().
+    void configTickless(SysTickControl* sysTick, Power* power = nullptr, Rtc* rtc = nullptr, unsigned int stopThresholdMs = 5);
+
+    void setTrapPriority(TrapIndex index, uint8_t priority);
+    // Write only the set bit, a read-modify-write of ICSR could set pending bits again.
+    void pendSV() { setRegister(&mBase->ICSR, 1 << 28); }
 
     void updateBogoMips();
     uint32_t bogoMips() { return mBogoMips; }
@@ -142,6 +238,10 @@ protected:
     void gpioEnable(int index);
     bool decodeRange(const char*& string, int& port, int& startPin, int& stopPin);
     int decodePin(const char*& string);
+    bool popEvent(Event*& event);
+    bool eventQueueEmpty();
+    void idle();
+    bool stop();
 
 private:
     struct SCB
@@ -272,14 +372,19 @@ private:
     };
 
     static const unsigned int STACK_MAGIC = 0xACE01234;
+    static const BaseAddress DWT_BASE = 0xe0001000;
+    static const BaseAddress DEMCR_OFFSET = 0xfc;
     static System* mSystem;
     static char* mHeapEnd;
 
     volatile SCB* mBase;
     uint32_t mBogoMips;
-    CircularBuffer<Event*> mEventQueue;
+    MpscQueue<Event*, 128> mEventQueue[Event::PRIORITY_COUNT];
     uint64_t mTimeInInterrupt;
     uint64_t mTimeIdle;
+    uint64_t mTimeSleep;
+    uint64_t mTimeStop;
+    uint32_t mStopCount;
     uint32_t mEventCount;
     uint32_t mInterruptCount;
 
@@ -287,6 +392,20 @@ private:
     int mGpioCount;
     uint32_t mGpioIsEnabled;
     ClockControl* mRcc;
+    Kernel* mKernel;
+    SysTickControl* mSysTick;
+    Power* mPower;
+    Rtc* mRtc;
+    unsigned int mStopThreshold;
+    CycleCounter* mCycleCounter;
+    HighResTimer* mHighResTimer;
+#ifdef IRQ_STATISTICS
+    InterruptStatistics mInterruptStatistics[VECTOR_COUNT];
+#endif
+#ifdef EVENT_STATISTICS
+    CallbackStatistics mCallbackStatistics[CALLBACK_STATISTICS_SIZE];
+    uint32_t mCallbackStatisticsLost;
+#endif
 
 };
 
@@ -0,0 +1,37 @@
+/*
+ * (c) 2012 Thomas Wihl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "Task.h"
+
+Task::Task(System::Event::Priority priority, const char *name) :
+    mState(FINISHED),
+    mEvent(*this, priority),
+    mName(name)
+{
+}
+
+void Task::start()
+{
+    mState = 0;
+    System::instance()->postEvent(&mEvent);
+}
+
+void Task::eventCallback(System::Event *event)
+{
+    if (event == &mEvent && mState != FINISHED) run();
+}
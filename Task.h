@@ -0,0 +1,78 @@
+/*
+ * (c) 2012 Thomas Wihl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef TASK_H
+#define TASK_H
+
+#include "System.h"
+
+// Cooperative, stackless task on top of System::Event (protothread style, as we are limited to C++11).
+// run() is resumed from the event loop every time the event of the task is posted, so a context switch
+// costs about as much as a function call. A task waits for a driver by handing event() to the driver and
+// then calling TASK_AWAIT(), e.g.:
+//
+//  void MyTask::run()
+//  {
+//      TASK_BEGIN();
+//      mTransfer.mEvent = event();
+//      mSpi.transfer(&mTransfer);
+//      TASK_AWAIT();
+//      TASK_AWAIT_IF(mSerial.read(mBuffer, sizeof(mBuffer), event()) == 0);
+//      TASK_END();
+//  }
+//
+// As there is no stack, local variables don't survive a TASK_AWAIT() or TASK_YIELD(), use members instead.
+// A switch statement can't be used between TASK_BEGIN() and TASK_END().
+class Task : public System::Event::Callback
+{
+public:
+    Task(System::Event::Priority priority = System::Event::Priority::Normal, const char* name = nullptr);
+    virtual ~Task() { }
+
+    void start();
+    bool finished() const { return mState == FINISHED; }
+    System::Event* event() { return &mEvent; }
+    virtual const char* name() const { return mName; }
+
+protected:
+    static const unsigned int FINISHED = ~0U;
+
+    virtual void run() = 0;
+    System::Event::Result result() { return mEvent.result(); }
+
+    virtual void eventCallback(System::Event* event);
+
+    unsigned int mState;
+    System::Event mEvent;
+    const char* mName;
+};
+
+#define TASK_BEGIN() switch (mState) { case 0:
+
+// Suspend until the event of the task is posted.
+#define TASK_AWAIT() do { mState = __LINE__; return; case __LINE__: ; } while (false)
+
+// Suspend until the event of the task is posted, but only if condition is true (e.g. the operation didn't complete immediately).
+#define TASK_AWAIT_IF(condition) do { if (condition) { mState = __LINE__; return; } case __LINE__: ; } while (false)
+
+// Let other events run and continue afterwards.
+#define TASK_YIELD() do { mState = __LINE__; System::instance()->postEvent(&mEvent); return; case __LINE__: ; } while (false)
+
+#define TASK_END() } mState = FINISHED
+
+#endif // TASK_H
@@ -22,7 +22,8 @@
 
 Timer::Timer(System::BaseAddress base, ClockControl::ClockSpeed clock) :
     mBase(reinterpret_cast<volatile TIMER*>(base)),
-    mClock(clock)
+    mClock(clock),
+    mCallback(nullptr)
 {
     static_assert(sizeof(TIMER) == 0x54, "Struct has wrong size, compiler problem.");
     for (unsigned i = 0; i < LINE_COUNT; ++i) mLine[i] = nullptr;
@@ -69,6 +70,11 @@ void Timer::setReload(uint32_t reload)
     mBase->ARR = reload;
 }
 
+void Timer::generateUpdate()
+{
+    mBase->EGR.UG = 1;
+}
+
 void Timer::setFrequency(const ClockControl &cc, uint32_t hz)
 {
     uint32_t clock = cc.clock(mClock);
@@ -211,5 +217,6 @@ void Timer::postEvent(Timer::EventType type)
 {
     int index = static_cast<int>(type);
     assert(index < EVENT_COUNT);
+    if (mCallback != nullptr) mCallback->timerCallback(type);
     if (mEvent[index] != nullptr) System::instance()->postEvent(mEvent[index]);
 }
@@ -53,6 +53,12 @@ public:
     enum class MasterMode { Reset = 0, Enable, Update, ComparePulse, Compare1, Compare2, Comapre3, Comapre4 };
     enum class SlaveMode { Disabled = 0, Encoder1, Encoder2, Encoder3, Reset, Gated, Trigger, ExternalClock };
     enum class Trigger { Internal0, Internal1, Internal2, Internal3, EdgeDetector, FilteredInput1, FilteredInput2, External };
+    class Callback
+    {
+    public:
+        // Called in interrupt context, before the event of the same type gets posted.
+        virtual void timerCallback(EventType type) = 0;
+    };
 
     Timer(System::BaseAddress base, ClockControl::ClockSpeed clock);
 
@@ -68,10 +74,13 @@ public:
     void setPrescaler(uint16_t prescaler);
     uint32_t prescaler() const { return mBase->PSC; }
     void setReload(uint32_t reload);
+    // Reloads counter and prescaler, a new prescaler takes effect with the next update only.
+    void generateUpdate();
     uint32_t reload() const { return mBase->ARR; }
     void setFrequency(const ClockControl& cc, uint32_t hz);
     void setOption(Option option);
     void setEvent(EventType type, System::Event* event);
+    void setCallback(Callback* callback) { mCallback = callback; }
     uint32_t capture(CaptureCompareIndex index);
     void setCompare(CaptureCompareIndex index, uint32_t compare);
     void setCountMode(CountMode mode);
@@ -256,6 +265,7 @@ private:
     ClockControl::ClockSpeed mClock;
     InterruptController::Line* mLine[LINE_COUNT];
     System::Event* mEvent[EVENT_COUNT];
+    Callback* mCallback;
 
     void postEvent(EventType type);
 };
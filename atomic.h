@@ -37,6 +37,39 @@ static inline void atomic_add(volatile int32_t* v, int inc)
         : "r" (v), "Ir" (inc)
         : "cc");
 }
+
+// Stores desired in *v if it still contains expected, fails if *v changed or we got interrupted in between.
+static inline bool atomic_compare_exchange(volatile unsigned int* v, unsigned int expected, unsigned int desired)
+{
+        unsigned int old;
+        unsigned int fail;
+
+        __asm__ __volatile__("@ atomic_compare_exchange\n"
+"       ldrex   %0, [%3]\n"
+"       mov     %1, #1\n"
+"       teq     %0, %4\n"
+"       it      eq\n"
+"       strexeq %1, %5, [%3]"
+        : "=&r" (old), "=&r" (fail), "+Qo" (*v)
+        : "r" (v), "r" (expected), "r" (desired)
+        : "cc", "memory");
+        return fail == 0;
+}
+
+// Masks all interrupts with configurable priority and returns the previous mask for interrupt_restore().
+static inline unsigned int interrupt_disable()
+{
+        unsigned int primask;
+        __asm__ __volatile__("mrs %0, primask\n"
+"       cpsid   i"
+        : "=r" (primask) : : "memory");
+        return primask;
+}
+
+static inline void interrupt_restore(unsigned int primask)
+{
+        __asm__ __volatile__("msr primask, %0" : : "r" (primask) : "memory");
+}
 #endif  // ARM
 
 #if __x86_64__ || __x86_32__ || __x86__
@@ -44,6 +77,32 @@ inline void atomic_add(volatile int32_t* v, int inc)
 {
     *v += inc;
 }
+
+inline bool atomic_compare_exchange(volatile unsigned int* v, unsigned int expected, unsigned int desired)
+{
+    return __sync_bool_compare_and_swap(v, expected, desired);
+}
+
+inline unsigned int interrupt_disable()
+{
+    return 0;
+}
+
+inline void interrupt_restore(unsigned int /*primask*/)
+{
+}
 #endif  // X86
 
+// Ordered load/store for single writer data (e.g. the indices of a lock free ring buffer).
+// The acquire load makes sure everything the other side wrote before its release store is visible.
+static inline unsigned int atomic_load_acquire(const volatile unsigned int* v)
+{
+    return __atomic_load_n(v, __ATOMIC_ACQUIRE);
+}
+
+static inline void atomic_store_release(volatile unsigned int* v, unsigned int value)
+{
+    __atomic_store_n(v, value, __ATOMIC_RELEASE);
+}
+
 #endif // ATOMIC_H
@@ -10,8 +10,7 @@
 I2C::I2C(System::BaseAddress base, ClockControl *clockControl, ClockControl::ClockSpeed clock) :
     mBase(reinterpret_cast<volatile IIC*>(base)),
     mClockControl(clockControl),
-    mClock(clock),
-    mTransferBuffer(64)
+    mClock(clock)
 {
     static_assert(sizeof(IIC_F4) == 0x24, "Struct has wrong size, compiler problem.");
     static_assert(sizeof(IIC_F7) == 0x2c, "Struct has wrong size, compiler problem.");
@@ -46,12 +45,14 @@ void I2C::configDma(Dma::Stream *write, Dma::Stream *read)
         mDmaWrite->config(Dma::Stream::Direction::MemoryToPeripheral, false, true, dataSize, dataSize, Dma::Stream::BurstLength::Single, Dma::Stream::BurstLength::Single);
         mDmaWrite->setAddress(Dma::Stream::End::Peripheral, reinterpret_cast<System::BaseAddress>(tdr()));
         mDmaWrite->configFifo(Dma::Stream::FifoThreshold::Quater);
+        mDmaWrite->setAutoOptimize(true);
     }
     if (Device::mDmaRead != nullptr)
     {
         mDmaRead->config(Dma::Stream::Direction::PeripheralToMemory, false, true, dataSize, dataSize, Dma::Stream::BurstLength::Single, Dma::Stream::BurstLength::Single);
         mDmaRead->setAddress(Dma::Stream::End::Peripheral, reinterpret_cast<System::BaseAddress>(rdr()));
-        mDmaWrite->configFifo(Dma::Stream::FifoThreshold::Quater);
+        mDmaRead->configFifo(Dma::Stream::FifoThreshold::Quater);
+        mDmaRead->setAutoOptimize(true);
     }
 }
 
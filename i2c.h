@@ -3,6 +3,7 @@
 
 #include "ClockControl.h"
 #include "Device.h"
+#include "CircularBuffer.h"
 
 
 #ifdef STM32F7
@@ -302,7 +303,7 @@ private:
     volatile IIC* mBase;
     ClockControl* mClockControl;
     ClockControl::ClockSpeed mClock;
-    CircularBuffer<Transfer*> mTransferBuffer;
+    CircularBuffer<Transfer*, 64> mTransferBuffer;
     InterruptController::Line *mEvent;
     InterruptController::Line *mError;
     Transfer* mActiveTransfer;
@@ -30,7 +30,7 @@ void MemoryController::sdRamConfig(SdRam *config1, SdRam *config2, SdRamClock cl
     mBase->SDCMR = mode.value;
     while (mBase->SDSR.BUSY) { }
 
-    System::instance()->usleep(100);
+    System::instance()->sleep(100);
 
     mode.bits.MODE = 2;
     mBase->SDCMR = mode.value;
@@ -1,12 +1,31 @@
 #include "stream.h"
+#include "CacheControl.h"
 
 Stream::Stream(System::BaseAddress base, ClockControl *clockControl, ClockControl::ClockSpeed clock, unsigned transmitBufferSize, unsigned receiveBufferSize) :
     Serial(base, clockControl, clock),
     mWriteFifo(transmitBufferSize),
-    mReadFifo(receiveBufferSize),
-    mLastTransferCount(receiveBufferSize)
+    mReadFifo(std::min<unsigned>(receiveBufferSize, MAX_RECEIVE_BUFFER_SIZE)),
+    mLastTransferCount(mReadFifo.size()),
+    mFramingMode(Framing::Mode::Cobs),
+    mFrameCallback(nullptr),
+    mFramePartial(0),
+    mFrameDrop(0),
+    mFrameBuffer(nullptr),
+    mFrameBufferSize(0),
+    mFramesReceived(0),
+    mFrameErrors(0),
+    mFrameEvent(*this),
+    mFlowControl(FlowControl::None),
+    mHighWatermark(0),
+    mLowWatermark(0),
+    mRts(nullptr),
+    mThrottled(false),
+    mFlowChar(0),
+    mDroppedBytes(0),
+    mOverruns(0)
 {
     clearReadRequest();
+    clearWriteRequest();
 }
 
 void Stream::configStream(Dma::Stream *write, Dma::Stream *read, InterruptController::Line *interrupt)
@@ -28,7 +47,12 @@ int Stream::read(char *data, unsigned len)
     {
         __asm ("wfi");
     }
-    return mReadFifo.read(data, len);
+    // The receive interrupt moves the read index too when the FIFO overflows.
+    unsigned int primask = interrupt_disable();
+    int count = mReadFifo.read(data, len);
+    interrupt_restore(primask);
+    checkFlowControl();
+    return count;
 }
 
 int Stream::read(char *data, unsigned len, System::Event *event)
@@ -47,36 +71,137 @@ int Stream::read(char *data, unsigned len, System::Event *event)
     return 0;
 }
 
-int Stream::write(const char *data, unsigned len)
+int Stream::write(const char *data, unsigned len, System::Event *event)
 {
     unsigned written = mWriteFifo.write(data, len);
     if (mDmaWrite == nullptr)
     {
         // In case of a trap DMA and IRQ are disabled, go on manually
-        char c;
-        while (mWriteFifo.pop(c))
+        writeDirect();
+        while (written != len)
         {
-            Serial::waitTransmitDataEmpty();
-            Serial::write(c);
+            written += mWriteFifo.write(data + written, len - written);
+            writeDirect();
         }
-        return len;
+        if (event != nullptr)
+        {
+            event->setResult(System::Event::Result::Success);
+            System::instance()->postEvent(event);
+        }
+        return written;
     }
     if (mDmaWrite->complete()) nextDmaWrite();
+    if (event != nullptr) notifyWritable(written == len ? mWriteFifo.size() : std::min(len - written, mWriteFifo.size() / 2), event);
+    return written;
+}
+
+void Stream::notifyWritable(unsigned len, System::Event *event)
+{
+    event->setResult(System::Event::Result::Success);
+    unsigned int primask = interrupt_disable();
+    mWriteRequest.event = event;
+    mWriteRequest.len = std::min(len, mWriteFifo.size());
+    // The DMA may have freed the space before we set the request
+    checkWriteRequest();
+    interrupt_restore(primask);
+}
+
+int Stream::writeAll(const char *data, unsigned len)
+{
+    unsigned written = write(data, len, nullptr);
     while (written != len)
     {
-        while (!mDmaWrite->complete())
-        {
-        }
-        written += mWriteFifo.write(data + written, len - written);
+        // The DMA complete interrupt wakes us up
+        System::instance()->yield();
+        written += write(data + written, len - written, nullptr);
     }
     return written;
 }
 
+unsigned Stream::consume(unsigned len)
+{
+    unsigned int primask = interrupt_disable();
+    len = mReadFifo.consume(len);
+    interrupt_restore(primask);
+    checkFlowControl();
+    return len;
+}
+
+void Stream::setFlowControl(Stream::FlowControl flowControl, unsigned high, unsigned low, Gpio::Pin *rts)
+{
+    if (mThrottled)
+    {
+        if (mFlowControl == FlowControl::Rts) mRts->reset();
+        else sendFlowChar(XON);
+        mThrottled = false;
+    }
+    mHighWatermark = high;
+    mLowWatermark = low;
+    mRts = rts;
+    mFlowControl = flowControl == FlowControl::Rts && rts == nullptr ? FlowControl::None : flowControl;
+    if (mFlowControl == FlowControl::Rts) mRts->reset();
+    checkFlowControl();
+}
+
+void Stream::setFraming(Framing::Mode mode, Stream::FrameCallback *callback, unsigned maxFrameSize)
+{
+    mFramingMode = mode;
+    delete[] mFrameBuffer;
+    mFrameBufferSize = maxFrameSize;
+    // Room for the CRC as well, frames get decoded into it with the data cache enabled.
+    mFrameBuffer = new char[mFrameBufferSize + Framing::CRC_SIZE];
+    mFrameCallback = callback;
+}
+
+bool Stream::writeFrame(const char *data, unsigned len)
+{
+    Region first, second;
+    unsigned size = Framing::maxEncodedSize(mFramingMode, len);
+    if (reserveWrite(size, first, second) < size) return false;
+    commitWrite(Framing::encode(mFramingMode, data, len, first, second));
+    return true;
+}
+
+unsigned Stream::commitWrite(unsigned len)
+{
+    len = mWriteFifo.commitWrite(len);
+    if (mDmaWrite == nullptr)
+    {
+        writeDirect();
+    }
+    else if (mDmaWrite->complete())
+    {
+        nextDmaWrite();
+    }
+    return len;
+}
+
+void Stream::writeDirect()
+{
+    char c;
+    while (mWriteFifo.pop(c))
+    {
+        Serial::waitTransmitDataEmpty();
+        Serial::write(c);
+    }
+}
+
+void Stream::checkWriteRequest()
+{
+    if (mWriteRequest.event != nullptr && mWriteFifo.free() >= mWriteRequest.len)
+    {
+        System::instance()->postEvent(mWriteRequest.event);
+        clearWriteRequest();
+    }
+}
+
 void Stream::nextDmaWrite()
 {
+    // The transmit interrupt sends XON/XOFF first and continues here.
+    if (mFlowChar != 0) return;
     unsigned len;
     const char* data;
-    len = mWriteFifo.getContBuffer(data);
+    len = std::min<unsigned>(mWriteFifo.getContBuffer(data), MAX_DMA_COUNT);
     if (len > 0)
     {
         mDmaWrite->setAddress(Dma::Stream::End::Memory, reinterpret_cast<uint32_t>(data));
@@ -94,7 +219,9 @@ void Stream::dmaReadComplete()
 void Stream::dmaWriteComplete()
 {
     mWriteFifo.skip(mDmaWrite->transferCount());
-    nextDmaWrite();
+    if (mFlowChar != 0) enableInterrupt(Interrupt::TransmitDataEmpty);
+    else nextDmaWrite();
+    checkWriteRequest();
 }
 
 void Stream::interrupt(Serial::Interrupt irq)
@@ -106,6 +233,14 @@ void Stream::interrupt(Serial::Interrupt irq)
         dataReadByDma();
         break;
     case Serial::Interrupt::TransmitDataEmpty:
+        if (mFlowChar != 0)
+        {
+            Serial::write(mFlowChar);
+            mFlowChar = 0;
+            enableInterrupt(Interrupt::TransmitDataEmpty, false);
+            nextDmaWrite();
+        }
+        break;
     case Serial::Interrupt::TransmitComplete:
     case Serial::Interrupt::DataRead:
         break;
@@ -114,7 +249,9 @@ void Stream::interrupt(Serial::Interrupt irq)
 
 void Stream::error(System::Event::Result result)
 {
+    if (result == System::Event::Result::OverrunError) ++mOverruns;
     if (mReadRequest.event != nullptr) mReadRequest.event->setResult(result);
+    if (mWriteRequest.event != nullptr) mWriteRequest.event->setResult(result);
 }
 
 void Stream::dataReadByDma()
@@ -126,8 +263,35 @@ void Stream::dataReadByDma()
         delta += mReadFifo.size();
     }
     mLastTransferCount = current;
+    // The circular DMA doesn't wait for the consumer, on overflow it already overwrote the oldest bytes. They are
+    // dropped, so the write index stays in step with the DMA.
+    unsigned free = mReadFifo.free();
+    if (static_cast<unsigned>(delta) > free)
+    {
+        unsigned used = mReadFifo.size() - free;
+        unsigned lost = mReadFifo.skip(delta - free);
+        mDroppedBytes += lost;
+        if (mFrameCallback != nullptr)
+        {
+            // The oldest bytes belong to the complete frames, eventCallback() counts them off their lengths. The
+            // rest comes off the partial frame, what remains of it fails to decode and the next delimiter resyncs.
+            unsigned framed = std::min(lost, used - mFramePartial);
+            mFrameDrop += framed;
+            mFramePartial -= lost - framed;
+        }
+    }
+    // Also needed for the idle interrupt, the DMA interrupts only drop the cache at half and full buffer.
+    Region first, second;
+    mReadFifo.reserveWrite(delta, first, second);
+    CacheControl::invalidate(reinterpret_cast<uintptr_t>(first.data), first.len);
+    CacheControl::invalidate(reinterpret_cast<uintptr_t>(second.data), second.len);
     mReadFifo.add(delta);
-    if (mReadRequest.data != nullptr)
+    if (mFrameCallback != nullptr)
+    {
+        scanFrames(first);
+        scanFrames(second);
+    }
+    else if (mReadRequest.data != nullptr)
     {
         unsigned len = mReadFifo.read(mReadRequest.data, mReadRequest.len);
         if (len == mReadRequest.len)
@@ -141,6 +305,7 @@ void Stream::dataReadByDma()
             mReadRequest.len -= len;
         }
     }
+    checkFlowControl();
 }
 
 void Stream::transmitDataEmpty()
@@ -149,3 +314,130 @@ void Stream::transmitDataEmpty()
     if (mWriteFifo.pop(c)) Serial::write(c);
     else enableInterrupt(Interrupt::TransmitDataEmpty, false);
 }
+
+// Only finds the frame boundaries, decoding is left to the event loop. If the queue is full, the bytes get merged
+// into the next frame, which then fails to decode. Without a delimiter for half the FIFO, we give up on the frame.
+void Stream::scanFrames(const Region &region)
+{
+    char delimiter = Framing::delimiter(mFramingMode);
+    const char* pos = region.data;
+    const char* end = region.data + region.len;
+    while (pos != end)
+    {
+        const char* found = static_cast<const char*>(memchr(pos, delimiter, end - pos));
+        if (found == nullptr)
+        {
+            mFramePartial += end - pos;
+            if (mFramePartial >= mReadFifo.size() / 2) pushFrame();
+            break;
+        }
+        mFramePartial += found + 1 - pos;
+        pos = found + 1;
+        pushFrame();
+    }
+}
+
+void Stream::pushFrame()
+{
+    bool wasEmpty = mFrameLengths.used() == 0;
+    if (!mFrameLengths.push(mFramePartial)) return;
+    mFramePartial = 0;
+    if (wasEmpty) System::instance()->postEvent(&mFrameEvent);
+}
+
+// The interrupt may drop the oldest bytes on overflow anytime, even those of the frame being decoded. So the
+// regions are taken and the frame consumed with interrupts disabled, and the frame is only decoded if none of it
+// was dropped before. If the interrupt drops it meanwhile, the callback may get garbage that passed the CRC.
+void Stream::eventCallback(System::Event */*event*/)
+{
+    unsigned len;
+    while (mFrameLengths.pop(len))
+    {
+        Region first, second;
+        unsigned int primask = interrupt_disable();
+        bool intact = mFrameDrop == 0;
+        if (intact) mReadFifo.peekRead(first, second);
+        interrupt_restore(primask);
+        if (intact) deliverFrame(len, first, second);
+        else if (len != 1) ++mFrameErrors;
+        primask = interrupt_disable();
+        unsigned lost = std::min(len, static_cast<unsigned>(mFrameDrop));
+        mFrameDrop -= lost;
+        mReadFifo.consume(len - lost);
+        interrupt_restore(primask);
+        checkFlowControl();
+    }
+}
+
+void Stream::deliverFrame(unsigned len, const Region& first, const Region& second)
+{
+    // Empty frames are just delimiters to resynchronize, SLIP senders often start with one.
+    if (len == 1) return;
+    // Decoding in place would leave dirty cache lines in the DMA ring, their write back could overwrite data
+    // the DMA received in the meantime. The copy is needed with the data cache only.
+    CacheControl* cache = CacheControl::instance();
+    if (cache != nullptr && cache->dataCacheEnabled())
+    {
+        int size = Framing::decode(mFramingMode, first, second, len, mFrameBuffer, mFrameBufferSize + Framing::CRC_SIZE);
+        if (size < 0)
+        {
+            ++mFrameErrors;
+            return;
+        }
+        ++mFramesReceived;
+        mFrameCallback->frameReceived(mFrameBuffer, size);
+        return;
+    }
+    int size = Framing::decode(mFramingMode, first, second, len);
+    if (size < 0)
+    {
+        ++mFrameErrors;
+        return;
+    }
+    if (static_cast<unsigned>(size) <= first.len)
+    {
+        ++mFramesReceived;
+        mFrameCallback->frameReceived(first.data, size);
+    }
+    else if (static_cast<unsigned>(size) <= mFrameBufferSize)
+    {
+        memcpy(mFrameBuffer, first.data, first.len);
+        memcpy(mFrameBuffer + first.len, second.data, size - first.len);
+        ++mFramesReceived;
+        mFrameCallback->frameReceived(mFrameBuffer, size);
+    }
+    else
+    {
+        ++mFrameErrors;
+    }
+}
+
+// Called whenever the receive FIFO level changes, from the interrupt as well as from the consumer.
+void Stream::checkFlowControl()
+{
+    if (mFlowControl == FlowControl::None) return;
+    unsigned int primask = interrupt_disable();
+    unsigned used = mReadFifo.used();
+    bool throttle = mThrottled ? used > mLowWatermark : used >= mHighWatermark;
+    if (throttle != mThrottled)
+    {
+        mThrottled = throttle;
+        if (mFlowControl == FlowControl::Rts) mRts->set(throttle);
+        else sendFlowChar(throttle ? XOFF : XON);
+    }
+    interrupt_restore(primask);
+}
+
+// A flow character still waiting gets replaced, only the latest state counts.
+void Stream::sendFlowChar(char c)
+{
+    if (mDmaWrite == nullptr)
+    {
+        Serial::waitTransmitDataEmpty();
+        Serial::write(c);
+        return;
+    }
+    mFlowChar = c;
+    // Otherwise dmaWriteComplete() enables the interrupt once the current transfer is done.
+    if (mDmaWrite->complete()) enableInterrupt(Interrupt::TransmitDataEmpty);
+}
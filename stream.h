@@ -2,20 +2,76 @@
 #define STREAM_H
 
 #include "CircularBuffer.h"
+#include "Framing.h"
+#include "Gpio.h"
 #include "Serial.h"
 
-class Stream : public Serial
+class Stream : public Serial, public System::Event::Callback
 {
 public:
+    class FrameCallback
+    {
+    public:
+        // Called from the event loop, data points into the receive FIFO (or a copy if the frame wrapped around
+        // or the data cache is enabled) and is only valid until the call returns.
+        virtual void frameReceived(const char* data, unsigned len) = 0;
+    };
+
+    // The receive DMA runs circular over the whole receive FIFO, NDTR counts at most 65535.
+    enum { MAX_RECEIVE_BUFFER_SIZE = 32768, MAX_DMA_COUNT = 65535 };
+
+    // Both FIFOs get rounded up to a power of two (see CircularBuffer), the receive FIFO to no more than
+    // MAX_RECEIVE_BUFFER_SIZE, larger sizes are clamped to it.
     Stream(System::BaseAddress base, ClockControl *clockControl, ClockControl::ClockSpeed clock, unsigned transmitBufferSize, unsigned receiveBufferSize);
-    virtual ~Stream() { }
+    virtual ~Stream() { delete[] mFrameBuffer; }
 
     void configStream(Dma::Stream *write, Dma::Stream *read, InterruptController::Line* interrupt);
 
     int read(char* data, unsigned len);
     int read(char* data, unsigned len, System::Event* event);
-    int write(const char* data, unsigned len);
+    // Blocks until everything is queued, see writeAll().
+    int write(const char* data, unsigned len) { return writeAll(data, len); }
+    // Queues as much as fits and returns the count without blocking. If the event is set, it gets posted
+    // once enough room for the rest (or half the FIFO) is free again, or once all data left the FIFO if
+    // everything fit. Only one write event can be pending, a new one replaces the previous.
+    int write(const char* data, unsigned len, System::Event* event);
+    // Queues everything, handling events or sleeping while the FIFO is full instead of spinning.
+    // Events handled meanwhile may write themselves, their data then ends up in between.
+    int writeAll(const char* data, unsigned len);
+    // Posts the event once len bytes are free in the transmit FIFO, replacing a pending write event.
+    void notifyWritable(unsigned len, System::Event* event);
+    // Bytes in the transmit FIFO that didn't leave yet, those the DMA is sending included.
+    unsigned transmitPending() { return mWriteFifo.used(); }
+    unsigned transmitBufferSize() { return mWriteFifo.size(); }
+
+    // Zero copy access to the FIFOs, see CircularBuffer::reserveWrite() and CircularBuffer::peekRead().
+    typedef CircularBuffer<char>::Region Region;
+    unsigned reserveWrite(unsigned len, Region& first, Region& second) { return mWriteFifo.reserveWrite(len, first, second); }
+    unsigned commitWrite(unsigned len);
+    unsigned peekRead(Region& first, Region& second) { return mReadFifo.peekRead(first, second); }
+    unsigned consume(unsigned len);
 
+    // The circular receive DMA overwrites data the consumer didn't fetch in time, so the sender gets throttled once
+    // the receive FIFO holds high bytes and released once it drained to low. Leave room above high for the bytes
+    // the sender transmits until it reacts. Rts drives the given pin (already configured as output, hardware RTS
+    // disabled) high to stop the sender, XonXoff sends XOFF and XON ahead of the queued transmit data.
+    enum class FlowControl { None, Rts, XonXoff };
+    void setFlowControl(FlowControl flowControl, unsigned high, unsigned low, Gpio::Pin* rts = nullptr);
+    bool throttled() const { return mThrottled; }
+    // Received bytes lost because the FIFO was full (the oldest ones, the DMA overwrote them), and overrun errors
+    // of the USART itself.
+    unsigned droppedBytes() const { return mDroppedBytes; }
+    unsigned overruns() const { return mOverruns; }
+
+    // Switches the receive side to frames, see Framing. The interrupt only looks for delimiters, the frames get
+    // decoded in place and handed to the callback by an event, read() must not be used anymore. Frames up to
+    // maxFrameSize payload bytes are delivered even if they wrap around the end of the receive FIFO. With the data
+    // cache enabled, every frame is decoded into a buffer of that size instead, longer ones count as errors.
+    void setFraming(Framing::Mode mode, FrameCallback* callback, unsigned maxFrameSize);
+    // Encodes the frame directly into the transmit FIFO, returns false without writing anything if it doesn't fit.
+    bool writeFrame(const char* data, unsigned len);
+    unsigned framesReceived() const { return mFramesReceived; }
+    unsigned frameErrors() const { return mFrameErrors; }
 
 private:
     CircularBuffer<char> mWriteFifo;
@@ -30,8 +86,42 @@ private:
     };
 
     Request mReadRequest;
+    // len is the free FIFO space that makes us post the event, the FIFO size waits until it drained.
+    Request mWriteRequest;
+
+    Framing::Mode mFramingMode;
+    FrameCallback* mFrameCallback;
+    // Lengths of the complete frames in the receive FIFO, in order, delimiter included.
+    CircularBuffer<unsigned, 16> mFrameLengths;
+    // Received bytes not yet ending in a delimiter.
+    unsigned mFramePartial;
+    // Bytes of complete frames the interrupt dropped on overflow, not yet counted off their lengths.
+    volatile unsigned mFrameDrop;
+    char* mFrameBuffer;
+    unsigned mFrameBufferSize;
+    unsigned mFramesReceived;
+    unsigned mFrameErrors;
+    System::Event mFrameEvent;
+
+    enum { XON = 0x11, XOFF = 0x13 };
+    FlowControl mFlowControl;
+    unsigned mHighWatermark;
+    unsigned mLowWatermark;
+    Gpio::Pin* mRts;
+    volatile bool mThrottled;
+    // XON or XOFF waiting for the transmitter, 0 if none.
+    volatile char mFlowChar;
+    unsigned mDroppedBytes;
+    unsigned mOverruns;
 
     void nextDmaWrite();
+    void writeDirect();
+    void checkWriteRequest();
+    void scanFrames(const Region& region);
+    void pushFrame();
+    void deliverFrame(unsigned len, const Region& first, const Region& second);
+    void checkFlowControl();
+    void sendFlowChar(char c);
 
     // Device interface
     void dmaReadComplete() override;
@@ -42,7 +132,12 @@ private:
     void error(System::Event::Result result);
     void dataReadByDma();
     void transmitDataEmpty();
+
+    // System::Event::Callback interface
+    void eventCallback(System::Event* event) override;
+    const char* name() const override { return "Stream"; }
     inline void clearReadRequest() { memset(&mReadRequest, 0, sizeof(mReadRequest)); }
+    inline void clearWriteRequest() { memset(&mWriteRequest, 0, sizeof(mWriteRequest)); }
 };
 
 #endif // STREAM_H
@@ -0,0 +1,145 @@
+/*
+ * (c) 2012 Thomas Wihl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef LEGACYCIRCULARBUFFER_H
+#define LEGACYCIRCULARBUFFER_H
+
+// The CircularBuffer before it became a single producer/single consumer ring, kept for the host benchmarks only.
+// The shared mUsed counter was updated with an LDREX/STREX loop on the target, an atomic add is the host equivalent.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+template<typename T>
+class LegacyCircularBuffer
+{
+public:
+    LegacyCircularBuffer(unsigned int size) : mSize(size), mBuffer(new T[size]), mWrite(mBuffer), mRead(mBuffer), mUsed(0) { }
+    ~LegacyCircularBuffer() { delete[] mBuffer; }
+
+    inline unsigned int used() { return mUsed; }
+    inline unsigned int free() { return mSize - used(); }
+    inline unsigned int size() { return mSize; }
+
+    bool push(T elem)
+    {
+        if (free() == 0) return false;
+        *mWrite = elem;
+        ++mWrite;
+        align(mWrite);
+        atomic_add(&mUsed, 1);
+        return true;
+    }
+
+    bool pop(T &elem)
+    {
+        if (used() == 0) return false;
+        elem = *mRead;
+        ++mRead;
+        align(mRead);
+        atomic_add(&mUsed, -1);
+        return true;
+    }
+
+    unsigned int write(const T* data, unsigned int len)
+    {
+        unsigned int totalLen = 0;
+        while (len > 0 && free() != 0)
+        {
+            unsigned int partLen = writePart(data, len);
+            data += partLen;
+            len -= partLen;
+            atomic_add(&mUsed, partLen);
+            totalLen += partLen;
+        }
+        return totalLen;
+    }
+
+    unsigned int read(T* data, unsigned int len)
+    {
+        unsigned int totalLen = 0;
+        while (len > 0 && used() != 0)
+        {
+            unsigned int partLen = readPart(data, len);
+            data += partLen;
+            len -= partLen;
+            atomic_add(&mUsed, -partLen);
+            totalLen += partLen;
+        }
+        return totalLen;
+    }
+
+    T* writePointer() { return const_cast<T*>(mWrite); }
+
+    unsigned int getContBuffer(const T*& data)
+    {
+        if (used() == 0) return 0;
+        data = const_cast<const T*>(mRead);
+        if (data < mWrite) return mWrite - data;
+        return (mBuffer + mSize) - data;
+    }
+
+    unsigned int skip(unsigned int len)
+    {
+        len = std::min(len, used());
+        mRead += len;
+        align(mRead);
+        atomic_add(&mUsed, -len);
+        return len;
+    }
+
+    unsigned int add(unsigned int len)
+    {
+        len = std::min(len, free());
+        mWrite += len;
+        align(mWrite);
+        atomic_add(&mUsed, len);
+        return len;
+    }
+
+private:
+    unsigned int mSize;
+    T* mBuffer;
+    volatile T* volatile mWrite;
+    volatile T* volatile mRead;
+    volatile int32_t mUsed;
+
+    static void atomic_add(volatile int32_t* v, int inc) { __atomic_fetch_add(v, inc, __ATOMIC_SEQ_CST); }
+    inline void align(volatile T* volatile& ptr) { while (ptr >= (mBuffer + mSize)) ptr -= mSize; }
+
+    unsigned int writePart(const T* data, unsigned int len)
+    {
+        unsigned int maxLen = std::min(static_cast<unsigned int>((mBuffer + mSize) - mWrite), std::min(len, free()));
+        std::memcpy(const_cast<T*>(mWrite), data, maxLen * sizeof(T));
+        mWrite += maxLen;
+        align(mWrite);
+        return maxLen;
+    }
+
+    unsigned int readPart(T* data, unsigned int len)
+    {
+        unsigned int maxLen = std::min(static_cast<unsigned int>((mBuffer + mSize) - mRead), std::min(len, used()));
+        std::memcpy(data, const_cast<T*>(mRead), maxLen * sizeof(T));
+        mRead += maxLen;
+        align(mRead);
+        return maxLen;
+    }
+};
+
+#endif // LEGACYCIRCULARBUFFER_H
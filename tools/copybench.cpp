@@ -0,0 +1,152 @@
+/*
+ * (c) 2012 Thomas Wihl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// Bytes copied by the CPU per byte moved through a Stream FIFO, with the copying read()/write() against the zero
+// copy peekRead()/consume() and reserveWrite()/commitWrite(). The DMA side of the FIFO is simulated with memcpy
+// and not counted, it costs the same either way. Build it from the top directory with
+//   g++ -std=c++11 -O2 -I. -o copybench tools/copybench.cpp
+
+#include "CircularBuffer.h"
+
+#include <chrono>
+#include <cstdio>
+
+namespace
+{
+
+enum { FIFO_SIZE = 1024, BLOCK = 200, TOTAL = 256 * 1024 * 1024 };
+
+typedef CircularBuffer<char>::Region Region;
+
+struct Result
+{
+    double seconds;
+    unsigned long long copied;
+    uint32_t checksum;
+};
+
+// What the DMA does on reception, fill the FIFO in place.
+void dmaReceive(CircularBuffer<char>& fifo, const char* data, unsigned int len)
+{
+    Region first, second;
+    len = fifo.reserveWrite(len, first, second);
+    memcpy(first.data, data, first.len);
+    memcpy(second.data, data + first.len, second.len);
+    fifo.commitWrite(len);
+}
+
+// What the DMA does on transmission, empty the FIFO.
+void dmaTransmit(CircularBuffer<char>& fifo, char* data)
+{
+    Region first, second;
+    unsigned int len = fifo.peekRead(first, second);
+    memcpy(data, first.data, first.len);
+    memcpy(data + first.len, second.data, second.len);
+    fifo.consume(len);
+}
+
+// The parser of the application, e.g. a protocol decoder.
+uint32_t parse(uint32_t sum, const char* data, unsigned int len)
+{
+    for (unsigned int i = 0; i < len; ++i) sum = sum * 31 + static_cast<uint8_t>(data[i]);
+    return sum;
+}
+
+// The formatter of the application, e.g. a protocol encoder.
+void format(char* data, unsigned int len, unsigned int position)
+{
+    for (unsigned int i = 0; i < len; ++i) data[i] = static_cast<char>(position + i);
+}
+
+Result receive(bool zeroCopy)
+{
+    CircularBuffer<char> fifo(FIFO_SIZE);
+    char wire[BLOCK];
+    format(wire, BLOCK, 0);
+    Result result = Result();
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned int received = 0; received < TOTAL; received += BLOCK)
+    {
+        dmaReceive(fifo, wire, BLOCK);
+        if (zeroCopy)
+        {
+            Region first, second;
+            unsigned int len = fifo.peekRead(first, second);
+            result.checksum = parse(parse(result.checksum, first.data, first.len), second.data, second.len);
+            fifo.consume(len);
+        }
+        else
+        {
+            char data[BLOCK];
+            unsigned int len = fifo.read(data, sizeof(data));
+            result.copied += len;
+            result.checksum = parse(result.checksum, data, len);
+        }
+    }
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return result;
+}
+
+Result transmit(bool zeroCopy)
+{
+    CircularBuffer<char> fifo(FIFO_SIZE);
+    char wire[BLOCK];
+    Result result = Result();
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned int sent = 0; sent < TOTAL; sent += BLOCK)
+    {
+        if (zeroCopy)
+        {
+            Region first, second;
+            unsigned int len = fifo.reserveWrite(BLOCK, first, second);
+            format(first.data, first.len, sent);
+            format(second.data, second.len, sent + first.len);
+            fifo.commitWrite(len);
+        }
+        else
+        {
+            char data[BLOCK];
+            format(data, BLOCK, sent);
+            result.copied += fifo.write(data, BLOCK);
+        }
+        dmaTransmit(fifo, wire);
+        result.checksum = parse(result.checksum, wire, BLOCK);
+    }
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return result;
+}
+
+void report(const char* name, const Result& copy, const Result& zeroCopy)
+{
+    printf("%-10s %12.2f %12.2f %10.1f %10.1f %s\n", name, static_cast<double>(copy.copied) / TOTAL, static_cast<double>(zeroCopy.copied) / TOTAL,
+           TOTAL / copy.seconds / 1e6, TOTAL / zeroCopy.seconds / 1e6, copy.checksum == zeroCopy.checksum ? "" : "CHECKSUM MISMATCH");
+}
+
+}
+
+int main()
+{
+    printf("%-10s %12s %12s %10s %10s\n", "PATH", "copies/byte", "zero copy", "MB/s", "zero copy");
+    Result copy = receive(false);
+    Result zeroCopy = receive(true);
+    report("receive", copy, zeroCopy);
+    copy = transmit(false);
+    zeroCopy = transmit(true);
+    report("transmit", copy, zeroCopy);
+    return 0;
+}
@@ -0,0 +1,189 @@
+/*
+ * (c) 2012 Thomas Wihl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// Host side counterpart of StreamMux: splits the frames coming from the serial device into one pseudo terminal per
+// channel and frames whatever gets written to those terminals for the device. Build it from the top directory with
+//   g++ -std=c++11 -O2 -I. -o muxdemux tools/muxdemux.cpp Framing.cpp
+// and connect a terminal program or a script to the /dev/pts/N printed for each channel.
+
+#include "Framing.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+namespace
+{
+
+enum { CHANNELS = 8, MAX_PAYLOAD = 64, MAX_FRAME = 4096 };
+
+struct Baud
+{
+    unsigned speed;
+    speed_t value;
+};
+
+const Baud BAUD[] =
+{
+    { 9600, B9600 }, { 19200, B19200 }, { 38400, B38400 }, { 57600, B57600 }, { 115200, B115200 }, { 230400, B230400 },
+    { 460800, B460800 }, { 921600, B921600 }, { 1000000, B1000000 }, { 2000000, B2000000 }, { 3000000, B3000000 }, { 4000000, B4000000 }
+};
+
+bool setRaw(int fd, unsigned speed)
+{
+    termios tio;
+    if (tcgetattr(fd, &tio) != 0) return false;
+    cfmakeraw(&tio);
+    for (const Baud& baud : BAUD)
+    {
+        if (baud.speed == speed) cfsetspeed(&tio, baud.value);
+    }
+    return tcsetattr(fd, TCSANOW, &tio) == 0;
+}
+
+bool writeAll(int fd, const char* data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t written = write(fd, data, len);
+        if (written < 0)
+        {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += written;
+        len -= written;
+    }
+    return true;
+}
+
+struct Channel
+{
+    int master;
+    // Kept open, so reading the master doesn't fail while no program has the terminal open.
+    int slave;
+};
+
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s <device> [speed] [slip]\n", argv[0]);
+        return 1;
+    }
+    unsigned speed = argc > 2 ? strtoul(argv[2], nullptr, 0) : 115200;
+    Framing::Mode mode = argc > 3 && strcmp(argv[3], "slip") == 0 ? Framing::Mode::Slip : Framing::Mode::Cobs;
+
+    int device = open(argv[1], O_RDWR | O_NOCTTY);
+    if (device < 0 || (isatty(device) && !setRaw(device, speed)))
+    {
+        perror(argv[1]);
+        return 1;
+    }
+
+    Channel channel[CHANNELS];
+    for (unsigned i = 0; i < CHANNELS; ++i)
+    {
+        channel[i].master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+        if (channel[i].master < 0 || grantpt(channel[i].master) != 0 || unlockpt(channel[i].master) != 0)
+        {
+            perror("posix_openpt");
+            return 1;
+        }
+        channel[i].slave = open(ptsname(channel[i].master), O_RDWR | O_NOCTTY);
+        setRaw(channel[i].slave, 0);
+        printf("channel %u: %s\n", i, ptsname(channel[i].master));
+    }
+    fflush(stdout);
+
+    static char frame[MAX_FRAME];
+    unsigned frameLen = 0;
+    unsigned errors = 0;
+    pollfd fds[CHANNELS + 1];
+    for (;;)
+    {
+        fds[0].fd = device;
+        fds[0].events = POLLIN;
+        for (unsigned i = 0; i < CHANNELS; ++i)
+        {
+            fds[i + 1].fd = channel[i].master;
+            fds[i + 1].events = POLLIN;
+        }
+        if (poll(fds, CHANNELS + 1, -1) < 0)
+        {
+            if (errno == EINTR) continue;
+            perror("poll");
+            return 1;
+        }
+        if (fds[0].revents & (POLLERR | POLLHUP))
+        {
+            fprintf(stderr, "%s: closed\n", argv[1]);
+            return 1;
+        }
+        if (fds[0].revents & POLLIN)
+        {
+            char buffer[1024];
+            ssize_t len = read(device, buffer, sizeof(buffer));
+            for (ssize_t i = 0; i < len; ++i)
+            {
+                // Too long frames get truncated, they fail the CRC then.
+                if (frameLen < MAX_FRAME) frame[frameLen++] = buffer[i];
+                if (buffer[i] != Framing::delimiter(mode)) continue;
+                Framing::Region first = { frame, frameLen };
+                Framing::Region second = { nullptr, 0 };
+                int size = frameLen > 1 ? Framing::decode(mode, first, second, frameLen) : 0;
+                unsigned id = CHANNELS;
+                if (size > 0) id = static_cast<uint8_t>(frame[0]);
+                if (id < CHANNELS)
+                {
+                    // Nobody reading the channel, drop it rather than stalling the others.
+                    if (write(channel[id].master, frame + 1, size - 1) < 0 && errno != EAGAIN) perror("write");
+                }
+                else if (frameLen > 1)
+                {
+                    fprintf(stderr, "bad frame (%u so far)\n", ++errors);
+                }
+                frameLen = 0;
+            }
+        }
+        for (unsigned i = 0; i < CHANNELS; ++i)
+        {
+            if ((fds[i + 1].revents & POLLIN) == 0) continue;
+            char payload[MAX_PAYLOAD + 1];
+            ssize_t len = read(channel[i].master, payload + 1, MAX_PAYLOAD);
+            if (len <= 0) continue;
+            payload[0] = static_cast<char>(i);
+            char encoded[2 * (MAX_PAYLOAD + 1 + Framing::CRC_SIZE) + 1];
+            Framing::Region first = { encoded, sizeof(encoded) };
+            Framing::Region second = { nullptr, 0 };
+            unsigned size = Framing::encode(mode, payload, len + 1, first, second);
+            if (!writeAll(device, encoded, size))
+            {
+                perror(argv[1]);
+                return 1;
+            }
+        }
+    }
+}
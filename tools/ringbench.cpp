@@ -0,0 +1,126 @@
+/*
+ * (c) 2012 Thomas Wihl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// Throughput of the lock free CircularBuffer against the LegacyCircularBuffer it replaced, with one producer and
+// one consumer thread like main loop and ISR on the target. A side that finds the buffer full or empty yields,
+// so it also runs on a single core. Build it from the top directory with
+//   g++ -std=c++11 -O2 -pthread -I. -o ringbench tools/ringbench.cpp
+// The numbers only compare the two implementations, the target is a lot slower but has the same ratio of memory
+// accesses to atomic operations.
+
+#include "CircularBuffer.h"
+#include "tools/LegacyCircularBuffer.h"
+
+#include <chrono>
+#include <cstdio>
+#include <thread>
+
+namespace
+{
+
+enum { BUFFER_SIZE = 1024, TOTAL = 64 * 1024 * 1024, BYTE_TOTAL = 16 * 1024 * 1024 };
+
+// Byte by byte, like a UART interrupt.
+template<class Buffer>
+double pushPop(Buffer& buffer, uint32_t& checksum)
+{
+    auto start = std::chrono::steady_clock::now();
+    std::thread producer([&buffer]()
+    {
+        for (unsigned int i = 0; i < BYTE_TOTAL; )
+        {
+            if (buffer.push(static_cast<char>(i))) ++i;
+            else std::this_thread::yield();
+        }
+    });
+    uint32_t sum = 0;
+    for (unsigned int i = 0; i < BYTE_TOTAL; )
+    {
+        char c;
+        if (buffer.pop(c))
+        {
+            sum = sum * 31 + static_cast<uint8_t>(c);
+            ++i;
+        }
+        else std::this_thread::yield();
+    }
+    producer.join();
+    checksum = sum;
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// In blocks, like the Stream FIFOs.
+template<class Buffer>
+double writeRead(Buffer& buffer, unsigned int block, uint32_t& checksum)
+{
+    auto start = std::chrono::steady_clock::now();
+    std::thread producer([&buffer, block]()
+    {
+        char data[BUFFER_SIZE];
+        for (unsigned int i = 0; i < block; ++i) data[i] = static_cast<char>(i);
+        for (unsigned int sent = 0; sent < TOTAL; )
+        {
+            unsigned int len = buffer.write(data, std::min<unsigned int>(block, TOTAL - sent));
+            if (len == 0) std::this_thread::yield();
+            sent += len;
+        }
+    });
+    uint32_t sum = 0;
+    char data[BUFFER_SIZE];
+    for (unsigned int received = 0; received < TOTAL; )
+    {
+        unsigned int len = buffer.read(data, block);
+        if (len == 0) std::this_thread::yield();
+        for (unsigned int i = 0; i < len; ++i) sum += static_cast<uint8_t>(data[i]);
+        received += len;
+    }
+    producer.join();
+    checksum = sum;
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void report(const char* name, double legacy, double lockFree, unsigned int bytes, uint32_t legacySum, uint32_t lockFreeSum)
+{
+    printf("%-16s %10.1f %10.1f %7.2fx %s\n", name, bytes / legacy / 1e6, bytes / lockFree / 1e6, legacy / lockFree, legacySum == lockFreeSum ? "" : "CHECKSUM MISMATCH");
+}
+
+}
+
+int main()
+{
+    printf("%-16s %10s %10s %8s\n", "TEST [MB/s]", "legacy", "lock free", "speedup");
+    uint32_t legacySum, lockFreeSum;
+    {
+        LegacyCircularBuffer<char> legacy(BUFFER_SIZE);
+        CircularBuffer<char> lockFree(BUFFER_SIZE);
+        double legacyTime = pushPop(legacy, legacySum);
+        double lockFreeTime = pushPop(lockFree, lockFreeSum);
+        report("push/pop", legacyTime, lockFreeTime, BYTE_TOTAL, legacySum, lockFreeSum);
+    }
+    for (unsigned int block : { 16, 64, 256 })
+    {
+        LegacyCircularBuffer<char> legacy(BUFFER_SIZE);
+        CircularBuffer<char> lockFree(BUFFER_SIZE);
+        double legacyTime = writeRead(legacy, block, legacySum);
+        double lockFreeTime = writeRead(lockFree, block, lockFreeSum);
+        char name[32];
+        snprintf(name, sizeof(name), "write/read %u", block);
+        report(name, legacyTime, lockFreeTime, TOTAL, legacySum, lockFreeSum);
+    }
+    return 0;
+}